@@ -0,0 +1,279 @@
+#include "cache.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <glib/gstdio.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/*
+ * Files in the cache may be read by other processes at any time, so they
+ * are never written in place: they are written to a temporary file next to
+ * them, synced to disk and renamed over the final path.
+ */
+
+/**
+ * cache_file_open:
+ * @path: path of a cached file
+ *
+ * Open a cached file for reading. With glibc, stdio reads the file from a
+ * mapping instead of with read() calls. That's all it saves: libsolv copies
+ * what it loads into its own memory either way, so this doesn't make the
+ * loaded pool any smaller or shared with other processes. The file is still
+ * backed by a file descriptor, which libsolv needs to page in data lazily.
+ * Other C libraries just read it.
+ *
+ * Returns: the open file, or %NULL with errno set
+ */
+FILE *
+cache_file_open (const char *path)
+{
+  return g_fopen (path, "rbm");
+}
+
+/**
+ * cache_file_create:
+ * @path: final path of the file
+ * @tmppath: (out): return location for the path of the temporary file
+ *
+ * Open a new temporary file to be moved to @path with cache_file_commit().
+ *
+ * Returns: the open file, or %NULL with errno set
+ */
+FILE *
+cache_file_create (const char  *path,
+                   gchar      **tmppath)
+{
+  g_autofree gchar *tmpl = g_strconcat (path, ".XXXXXX", NULL);
+  int fd = g_mkstemp (tmpl);
+  if (fd == -1)
+    return NULL;
+
+  FILE *fp = fdopen (fd, "wb");
+  if (!fp)
+    {
+      int saved_errno = errno;
+      close (fd);
+      g_unlink (tmpl);
+      errno = saved_errno;
+      return NULL;
+    }
+
+  *tmppath = g_steal_pointer (&tmpl);
+  return fp;
+}
+
+/**
+ * cache_file_commit:
+ * @fp: file returned by cache_file_create()
+ * @tmppath: its path
+ * @path: final path of the file
+ * @error: return location for a #GError
+ *
+ * Close @fp and atomically replace @path with it once its contents are on
+ * the disk. The temporary file is removed on failure.
+ *
+ * Returns: %TRUE if @path was replaced
+ */
+gboolean
+cache_file_commit (FILE        *fp,
+                   const char  *tmppath,
+                   const char  *path,
+                   GError     **error)
+{
+  gboolean synced = fflush (fp) == 0 && fsync (fileno (fp)) == 0;
+  int saved_errno = errno;
+
+  if (fclose (fp) != 0 || !synced)
+    {
+      g_set_error (error,
+                   G_OPTION_ERROR, G_OPTION_ERROR_FAILED,
+                   "Could not write %s: %s",
+                   tmppath, g_strerror (synced ? errno : saved_errno));
+      g_unlink (tmppath);
+      return FALSE;
+    }
+
+  if (g_rename (tmppath, path) == -1)
+    {
+      g_set_error (error,
+                   G_OPTION_ERROR, G_OPTION_ERROR_FAILED,
+                   "Could not rename %s: %s", tmppath, g_strerror (errno));
+      g_unlink (tmppath);
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+/* Make sure what was written to @path is on the disk, so that it can be
+ * renamed to a final path */
+gboolean
+cache_sync_path (const char *path)
+{
+  int fd = g_open (path, O_RDONLY | O_CLOEXEC, 0);
+  if (fd == -1)
+    return FALSE;
+
+  gboolean ret = fsync (fd) == 0;
+  close (fd);
+  return ret;
+}
+
+/**
+ * cache_lock:
+ * @dir: cache directory
+ * @error: return location for a #GError
+ *
+ * Take an exclusive advisory lock on @dir, waiting for other processes
+ * holding it to release it. The lock is released when the returned file
+ * descriptor is closed, or when the process exits.
+ *
+ * Returns: file descriptor holding the lock, or -1 on error
+ */
+int
+cache_lock (const char  *dir,
+            GError     **error)
+{
+  g_autofree gchar *path = g_build_filename (dir, "lock", NULL);
+  int fd = g_open (path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+  if (fd == -1)
+    {
+      g_set_error (error,
+                   G_OPTION_ERROR, G_OPTION_ERROR_FAILED,
+                   "Could not open %s: %s", path, g_strerror (errno));
+      return -1;
+    }
+
+  int ret = flock (fd, LOCK_EX | LOCK_NB);
+  if (ret == -1 && errno == EWOULDBLOCK)
+    {
+      g_info ("Waiting for another process to release %s", path);
+      do
+        ret = flock (fd, LOCK_EX);
+      while (ret == -1 && errno == EINTR);
+    }
+
+  if (ret == -1)
+    {
+      g_set_error (error,
+                   G_OPTION_ERROR, G_OPTION_ERROR_FAILED,
+                   "Could not lock %s: %s", path, g_strerror (errno));
+      close (fd);
+      return -1;
+    }
+
+  return fd;
+}
+
+typedef struct
+{
+  gchar   *path;
+  guint64  size;
+  /* Last time the file was read or written */
+  gint64   used;
+} CacheEntry;
+
+static void
+cache_entry_clear (gpointer data)
+{
+  g_free (((CacheEntry *) data)->path);
+}
+
+static gint
+cache_entry_compare (gconstpointer a,
+                     gconstpointer b)
+{
+  const CacheEntry *ea = a, *eb = b;
+  return (ea->used > eb->used) - (ea->used < eb->used);
+}
+
+/* Add the files under @dir which are not to be kept to @entries, and
+ * return the size of all of them */
+static guint64
+cache_scan (const char    *dir,
+            const char    *reldir,
+            CacheKeepFunc  keep,
+            gpointer       user_data,
+            GArray        *entries)
+{
+  g_autoptr(GDir) d = g_dir_open (dir, 0, NULL);
+  if (!d)
+    return 0;
+
+  guint64 total = 0;
+  const char *name;
+  while ((name = g_dir_read_name (d)))
+    {
+      g_autofree gchar *path = g_build_filename (dir, name, NULL);
+      g_autofree gchar *relpath = reldir ? g_build_filename (reldir, name, NULL) : g_strdup (name);
+      GStatBuf st;
+      if (g_lstat (path, &st) == -1)
+        continue;
+
+      if (S_ISDIR (st.st_mode))
+        {
+          total += cache_scan (path, relpath, keep, user_data, entries);
+          continue;
+        }
+      if (!S_ISREG (st.st_mode))
+        continue;
+
+      total += st.st_size;
+      if (keep (relpath, user_data))
+        continue;
+
+      CacheEntry entry = { g_steal_pointer (&path), st.st_size, MAX (st.st_atime, st.st_mtime) };
+      g_array_append_val (entries, entry);
+    }
+
+  return total;
+}
+
+/**
+ * cache_gc:
+ * @dir: cache directory
+ * @keep: function telling which files must never be removed
+ * @user_data: data passed to @keep
+ * @max_size: size in bytes the files in @dir should fit in, or 0
+ * @max_age: seconds after which files which weren't used are removed, or 0
+ *
+ * Remove the files in @dir which haven't been used for longer than
+ * @max_age, and then the least recently used ones until everything fits in
+ * @max_size. When the files are last used is known from their access time,
+ * so on file systems mounted with noatime it's only when they were written.
+ * This must only be called with the lock of @dir held.
+ */
+void
+cache_gc (const char    *dir,
+          CacheKeepFunc  keep,
+          gpointer       user_data,
+          guint64        max_size,
+          gint64         max_age)
+{
+  if (!max_size && !max_age)
+    return;
+
+  g_autoptr(GArray) entries = g_array_new (FALSE, FALSE, sizeof (CacheEntry));
+  g_array_set_clear_func (entries, cache_entry_clear);
+  guint64 total = cache_scan (dir, NULL, keep, user_data, entries);
+  g_array_sort (entries, cache_entry_compare);
+
+  gint64 now = g_get_real_time () / G_USEC_PER_SEC;
+  for (guint i = 0; i < entries->len; i++)
+    {
+      CacheEntry *entry = &g_array_index (entries, CacheEntry, i);
+      gboolean expired = max_age && now - entry->used > max_age;
+      if (!expired && (!max_size || total <= max_size))
+        break;
+
+      if (g_unlink (entry->path) == -1)
+        {
+          g_debug ("Could not remove %s: %s", entry->path, g_strerror (errno));
+          continue;
+        }
+      g_debug ("Removed %s from cache", entry->path);
+      total -= entry->size;
+    }
+}
@@ -0,0 +1,16 @@
+#pragma once
+
+#include <glib.h>
+#include <stdio.h>
+
+FILE *cache_file_open (const char *path);
+FILE *cache_file_create (const char *path, gchar **tmppath);
+gboolean cache_file_commit (FILE *fp, const char *tmppath, const char *path, GError **error);
+gboolean cache_sync_path (const char *path);
+
+int cache_lock (const char *dir, GError **error);
+
+/* Whether the file at @relpath, relative to the cache dir, must be kept */
+typedef gboolean (*CacheKeepFunc) (const char *relpath, gpointer user_data);
+
+void cache_gc (const char *dir, CacheKeepFunc keep, gpointer user_data, guint64 max_size, gint64 max_age);
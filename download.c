@@ -0,0 +1,966 @@
+#include "download.h"
+#include "cache.h"
+
+#include <errno.h>
+#include <gio/gio.h>
+#include <glib/gstdio.h>
+#include <solv/solv_xfopen.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#define DOWNLOAD_BUFSIZE (64 * 1024)
+/* Transfers failing for reasons which may be temporary are tried again, each
+ * time waiting twice as long as the previous one */
+#define DOWNLOAD_MAX_ATTEMPTS 4
+#define DOWNLOAD_RETRY_DELAY_MS 500
+
+typedef struct
+{
+  SoupSession *session;
+  GQueue       pending;
+  guint        running;
+} DownloadQueue;
+
+/*
+ * Data are written to a .part file next to the final path, renamed to it once
+ * complete and verified. If a transfer breaks, the .part file is kept and the
+ * next attempt only asks the server for the missing bytes.
+ */
+typedef struct
+{
+  DownloadQueue *queue;
+  Download      *dl;
+  char          *partpath;
+  SoupMessage   *msg;
+  GInputStream  *istream;
+  GOutputStream *ostream;
+  Chksum        *chksum;
+  /* Number of bytes already in the .part file */
+  goffset        offset;
+  gint64         started;
+  guint          attempt;
+  /* Whether the current attempt continues from a .part file */
+  gboolean       resumed;
+  /* Whether the .part file is worth resuming from later */
+  gboolean       keep_part;
+  guchar         buf[DOWNLOAD_BUFSIZE];
+} DownloadJob;
+
+Download *
+download_new (const char *url,
+              const char *path)
+{
+  Download *dl = g_new0 (Download, 1);
+  dl->url = g_strdup (url);
+  dl->path = g_strdup (path);
+  return dl;
+}
+
+void
+download_set_checksum (Download            *dl,
+                       Id                   chksumtype,
+                       const unsigned char *chksum)
+{
+  if (dl->expected)
+    solv_chksum_free (dl->expected, NULL);
+  dl->expected = chksum ? solv_chksum_create_from_bin (chksumtype, chksum) : NULL;
+}
+
+/**
+ * download_set_mirrors:
+ * @dl: a #Download
+ * @mirrors: base URLs of the mirrors, in order of preference
+ * @relpath: path of the file relative to a base URL
+ *
+ * Let @dl fall back to the other mirrors when downloading from its URL
+ * fails, even after retrying.
+ */
+void
+download_set_mirrors (Download   *dl,
+                      GPtrArray  *mirrors,
+                      const char *relpath)
+{
+  g_clear_pointer (&dl->mirrors, g_ptr_array_unref);
+  g_free (dl->relpath);
+  dl->mirrors = mirrors ? g_ptr_array_ref (mirrors) : NULL;
+  dl->relpath = g_strdup (relpath);
+  dl->mirror = -1;
+}
+
+/* Switch to the next mirror not tried yet */
+static gboolean
+download_next_mirror (Download *dl)
+{
+  while (dl->mirrors && dl->mirror + 1 < (gint) dl->mirrors->len)
+    {
+      dl->mirror++;
+      g_autofree gchar *url = g_strconcat (g_ptr_array_index (dl->mirrors, dl->mirror),
+                                           "/", dl->relpath, NULL);
+      if (g_strcmp0 (url, dl->url) == 0)
+        continue;
+
+      g_debug ("Falling back to %s", url);
+      g_free (dl->url);
+      dl->url = g_steal_pointer (&url);
+      return TRUE;
+    }
+
+  return FALSE;
+}
+
+void
+download_free (Download *dl)
+{
+  g_free (dl->url);
+  g_free (dl->path);
+  g_free (dl->relpath);
+  if (dl->mirrors)
+    g_ptr_array_unref (dl->mirrors);
+  if (dl->expected)
+    solv_chksum_free (dl->expected, NULL);
+  g_clear_error (&dl->error);
+  g_free (dl);
+}
+
+static void download_start_next (DownloadQueue *queue);
+
+/*
+ * Cache validators (ETag and Last-Modified) the server sent with the copy at
+ * dl->path are stored next to it, so that the next conditional request can
+ * let the server answer with 304 Not Modified instead of the whole file.
+ */
+static gchar *
+validators_path (Download *dl)
+{
+  return g_strconcat (dl->path, ".headers", NULL);
+}
+
+static void
+download_add_validators (Download    *dl,
+                         SoupMessage *msg)
+{
+  if (!g_file_test (dl->path, G_FILE_TEST_IS_REGULAR))
+    return;
+
+  g_autofree gchar *vpath = validators_path (dl);
+  g_autofree gchar *contents = NULL;
+  if (!g_file_get_contents (vpath, &contents, NULL, NULL))
+    return;
+
+  g_auto(GStrv) lines = g_strsplit (contents, "\n", -1);
+  for (GStrv line = lines; *line; line++)
+    {
+      if (g_str_has_prefix (*line, "ETag: "))
+        soup_message_headers_replace (msg->request_headers, "If-None-Match",
+                                      *line + strlen ("ETag: "));
+      else if (g_str_has_prefix (*line, "Last-Modified: "))
+        soup_message_headers_replace (msg->request_headers, "If-Modified-Since",
+                                      *line + strlen ("Last-Modified: "));
+    }
+}
+
+static void
+download_save_validators (Download    *dl,
+                          SoupMessage *msg)
+{
+  g_autofree gchar *vpath = validators_path (dl);
+  const char *etag = soup_message_headers_get_one (msg->response_headers, "ETag");
+  const char *modified = soup_message_headers_get_one (msg->response_headers, "Last-Modified");
+  if (!etag && !modified)
+    {
+      g_unlink (vpath);
+      return;
+    }
+
+  g_autoptr(GString) contents = g_string_new (NULL);
+  if (etag)
+    g_string_append_printf (contents, "ETag: %s\n", etag);
+  if (modified)
+    g_string_append_printf (contents, "Last-Modified: %s\n", modified);
+
+  g_autoptr(GError) error = NULL;
+  if (!g_file_set_contents (vpath, contents->str, contents->len, &error))
+    g_debug ("Could not save %s: %s", vpath, error->message);
+}
+
+static DownloadJob *
+download_job_new (DownloadQueue *queue,
+                  Download      *dl)
+{
+  DownloadJob *job = g_new0 (DownloadJob, 1);
+  job->queue = queue;
+  job->dl = dl;
+  job->partpath = g_strconcat (dl->path, ".part", NULL);
+  return job;
+}
+
+/* Drop the state of the current attempt, keeping the .part file */
+static void
+download_job_reset (DownloadJob *job)
+{
+  if (job->ostream)
+    g_output_stream_close (job->ostream, NULL, NULL);
+  g_clear_object (&job->ostream);
+  g_clear_object (&job->istream);
+  g_clear_object (&job->msg);
+  if (job->chksum)
+    job->chksum = solv_chksum_free (job->chksum, NULL);
+}
+
+/* Close the downloaded file, move it in place and free the job */
+static void
+download_job_complete (DownloadJob *job)
+{
+  Download *dl = job->dl;
+
+  if (job->ostream && !g_output_stream_close (job->ostream, NULL, dl->error ? NULL : &dl->error))
+    job->keep_part = FALSE;
+
+  /* Others sharing the cache may use the file as soon as it's renamed */
+  if (job->ostream && !dl->error && !cache_sync_path (job->partpath))
+    g_set_error (&dl->error,
+                 G_OPTION_ERROR, G_OPTION_ERROR_FAILED,
+                 "Could not sync %s: %s", job->partpath, g_strerror (errno));
+
+  if (job->ostream && !dl->error && g_rename (job->partpath, dl->path) == -1)
+    g_set_error (&dl->error,
+                 G_OPTION_ERROR, G_OPTION_ERROR_FAILED,
+                 "Could not rename %s: %s", job->partpath, g_strerror (errno));
+
+  /* Never leave a truncated or corrupted file behind, only what can be
+   * resumed from */
+  if (dl->error && !job->keep_part)
+    g_unlink (job->partpath);
+
+  if (!dl->error && dl->conditional && job->msg && !dl->not_modified)
+    download_save_validators (dl, job->msg);
+
+  download_job_reset (job);
+  g_free (job->partpath);
+  g_free (job);
+}
+
+static void
+download_job_finish (DownloadJob *job)
+{
+  DownloadQueue *queue = job->queue;
+
+  if (job->started)
+    job->dl->elapsed = g_get_monotonic_time () - job->started;
+
+  download_job_complete (job);
+
+  queue->running--;
+  download_start_next (queue);
+}
+
+static void download_job_send (DownloadJob *job);
+
+static gboolean
+download_job_retry_cb (gpointer user_data)
+{
+  download_job_send (user_data);
+  return G_SOURCE_REMOVE;
+}
+
+static guint
+download_max_attempts (Download *dl)
+{
+  return dl->max_attempts ? dl->max_attempts : DOWNLOAD_MAX_ATTEMPTS;
+}
+
+/*
+ * Give up on the current attempt, which failed with dl->error. If the
+ * failure may be temporary, try again later, otherwise try the next mirror
+ * if any, or finish the job.
+ */
+static void
+download_job_fail (DownloadJob *job,
+                   gboolean     transient)
+{
+  Download *dl = job->dl;
+
+  job->keep_part = transient;
+  if (!transient || job->attempt + 1 >= download_max_attempts (dl))
+    {
+      /* The file may still be available from another mirror */
+      g_autofree gchar *failed = g_strdup (dl->url);
+      if (download_next_mirror (dl))
+        {
+          g_debug ("Could not download %s: %s", failed, dl->error->message);
+          g_clear_error (&dl->error);
+          download_job_reset (job);
+          job->attempt = 0;
+          download_job_send (job);
+          return;
+        }
+
+      download_job_finish (job);
+      return;
+    }
+
+  guint delay = DOWNLOAD_RETRY_DELAY_MS << job->attempt;
+  g_debug ("Retrying %s in %u ms: %s", dl->url, delay, dl->error->message);
+  g_clear_error (&dl->error);
+  download_job_reset (job);
+  job->attempt++;
+
+  GSource *source = g_timeout_source_new (delay);
+  g_source_set_callback (source, download_job_retry_cb, job, NULL);
+  g_source_attach (source, g_main_context_get_thread_default ());
+  g_source_unref (source);
+}
+
+/* Whether a request failing with @status is worth trying again */
+static gboolean
+status_is_transient (guint status)
+{
+  /* 429 is Too Many Requests */
+  return SOUP_STATUS_IS_SERVER_ERROR (status) ||
+         status == SOUP_STATUS_REQUEST_TIMEOUT ||
+         status == 429;
+}
+
+static gboolean
+download_job_check_status (DownloadJob *job)
+{
+  if (SOUP_STATUS_IS_SUCCESSFUL (job->msg->status_code))
+    return TRUE;
+
+  g_set_error (&job->dl->error,
+               G_OPTION_ERROR, G_OPTION_ERROR_FAILED,
+               "Server returned %u %s",
+               job->msg->status_code, job->msg->reason_phrase);
+  return FALSE;
+}
+
+static gboolean send_all (int fd, const guchar *buf, gsize len);
+
+/*
+ * Hash what a previous attempt left in the .part file, so the download can
+ * continue from there. Only done when the checksum is known, otherwise
+ * there would be no way to tell whether the pieces fit together. Unless @fd
+ * is -1, the contents are sent to it as well, and %FALSE is returned if they
+ * can't be continued from after some of them were sent.
+ */
+static gboolean
+download_job_load_part (DownloadJob *job,
+                        int          fd)
+{
+  Download *dl = job->dl;
+
+  job->offset = 0;
+  if (!dl->expected)
+    return TRUE;
+
+  job->chksum = solv_chksum_create (solv_chksum_get_type (dl->expected));
+  FILE *fp = g_fopen (job->partpath, "rb");
+  if (!fp)
+    return TRUE;
+
+  size_t len;
+  gboolean sent = FALSE;
+  while ((len = fread (job->buf, 1, sizeof (job->buf), fp)) > 0)
+    {
+      solv_chksum_add (job->chksum, job->buf, len);
+      job->offset += len;
+      if (fd != -1)
+        sent |= send_all (fd, job->buf, len);
+    }
+  if (ferror (fp))
+    {
+      solv_chksum_free (job->chksum, NULL);
+      job->chksum = solv_chksum_create (solv_chksum_get_type (dl->expected));
+      job->offset = 0;
+    }
+  fclose (fp);
+
+  return job->offset > 0 || !sent;
+}
+
+/*
+ * Open the .part file for writing. Unless @append, it is truncated first and
+ * hashing starts over.
+ */
+static gboolean
+download_job_open (DownloadJob *job,
+                   gboolean     append)
+{
+  Download *dl = job->dl;
+
+  if (!append)
+    {
+      g_unlink (job->partpath);
+      job->offset = 0;
+      if (job->chksum)
+        solv_chksum_free (job->chksum, NULL);
+      job->chksum = dl->expected ? solv_chksum_create (solv_chksum_get_type (dl->expected)) : NULL;
+    }
+
+  job->resumed = append;
+
+  /* Written directly rather than through a temporary file, so that what
+   * made it to the disk survives an interrupted run */
+  g_autoptr(GFile) file = g_file_new_for_path (job->partpath);
+  job->ostream = G_OUTPUT_STREAM (g_file_append_to (file, G_FILE_CREATE_NONE, NULL, &dl->error));
+
+  return job->ostream != NULL;
+}
+
+/* Write a chunk of @len bytes from the job's buffer, hashing it on the way */
+static gboolean
+download_job_write (DownloadJob *job,
+                    gsize        len)
+{
+  if (job->chksum)
+    solv_chksum_add (job->chksum, job->buf, len);
+
+  if (!g_output_stream_write_all (job->ostream, job->buf, len, NULL, NULL, &job->dl->error))
+    return FALSE;
+
+  job->offset += len;
+  return TRUE;
+}
+
+/* The checksum was computed while writing, so there is no need to read the
+ * file back to verify it. */
+static gboolean
+download_job_verify (DownloadJob *job)
+{
+  Download *dl = job->dl;
+
+  if (!job->chksum || solv_chksum_cmp (job->chksum, dl->expected))
+    return TRUE;
+
+  g_set_error (&dl->error,
+               G_OPTION_ERROR, G_OPTION_ERROR_FAILED,
+               "Checksum mismatch for %s", dl->url);
+  return FALSE;
+}
+
+/*
+ * Check the response of a request which asked for the data from
+ * job->offset on, and open the .part file accordingly.
+ */
+static gboolean
+download_job_open_response (DownloadJob *job)
+{
+  SoupMessage *msg = job->msg;
+  goffset start, end, total;
+
+  if (job->offset > 0 && msg->status_code == SOUP_STATUS_PARTIAL_CONTENT)
+    {
+      if (!soup_message_headers_get_content_range (msg->response_headers, &start, &end, &total) ||
+          start != job->offset)
+        {
+          g_set_error (&job->dl->error,
+                       G_OPTION_ERROR, G_OPTION_ERROR_FAILED,
+                       "Server returned an unexpected range");
+          return FALSE;
+        }
+      g_debug ("Resuming %s from %" G_GOFFSET_FORMAT " bytes", job->dl->url, job->offset);
+      return download_job_open (job, TRUE);
+    }
+
+  /* The server doesn't support ranges and sent the whole file */
+  return download_job_open (job, FALSE);
+}
+
+static void
+download_read_cb (GObject      *source,
+                  GAsyncResult *res,
+                  gpointer      user_data)
+{
+  DownloadJob *job = user_data;
+  Download *dl = job->dl;
+
+  gssize len = g_input_stream_read_finish (G_INPUT_STREAM (source), res, &dl->error);
+  if (len < 0)
+    {
+      /* The connection broke, what arrived so far is kept */
+      download_job_fail (job, TRUE);
+      return;
+    }
+
+  if (len == 0)
+    {
+      if (!download_job_verify (job))
+        {
+          /* If the file was resumed, the .part file may have been left by
+           * a different version of it, so try again from scratch. */
+          g_unlink (job->partpath);
+          download_job_fail (job, job->resumed);
+          return;
+        }
+      download_job_finish (job);
+      return;
+    }
+
+  if (!download_job_write (job, len))
+    {
+      download_job_fail (job, FALSE);
+      return;
+    }
+
+  g_input_stream_read_async (job->istream, job->buf, sizeof (job->buf),
+                             G_PRIORITY_DEFAULT, NULL, download_read_cb, job);
+}
+
+static void
+download_sent_cb (GObject      *source,
+                  GAsyncResult *res,
+                  gpointer      user_data)
+{
+  DownloadJob *job = user_data;
+  Download *dl = job->dl;
+
+  job->istream = soup_session_send_finish (SOUP_SESSION (source), res, &dl->error);
+  dl->latency = g_get_monotonic_time () - job->started;
+  if (!job->istream)
+    {
+      download_job_fail (job, TRUE);
+      return;
+    }
+
+  if (dl->conditional && job->msg->status_code == SOUP_STATUS_NOT_MODIFIED)
+    {
+      g_debug ("%s not modified", dl->url);
+      dl->not_modified = TRUE;
+      /* The mtime of the copy is the last time it was known to be current */
+      g_utime (dl->path, NULL);
+      download_job_finish (job);
+      return;
+    }
+
+  if (job->msg->status_code == SOUP_STATUS_REQUESTED_RANGE_NOT_SATISFIABLE)
+    {
+      /* The .part file is not a prefix of the file on the server */
+      g_set_error (&dl->error,
+                   G_OPTION_ERROR, G_OPTION_ERROR_FAILED,
+                   "Server could not resume %s", dl->url);
+      g_unlink (job->partpath);
+      download_job_fail (job, TRUE);
+      return;
+    }
+
+  if (!download_job_check_status (job))
+    {
+      download_job_fail (job, status_is_transient (job->msg->status_code));
+      return;
+    }
+
+  if (!download_job_open_response (job))
+    {
+      download_job_fail (job, FALSE);
+      return;
+    }
+
+  g_input_stream_read_async (job->istream, job->buf, sizeof (job->buf),
+                             G_PRIORITY_DEFAULT, NULL, download_read_cb, job);
+}
+
+static void
+download_job_send (DownloadJob *job)
+{
+  Download *dl = job->dl;
+
+  /* Conditional downloads are of small files which are usually not
+   * modified, so they are not worth resuming */
+  if (!dl->conditional)
+    download_job_load_part (job, -1);
+
+  job->msg = soup_message_new ("GET", dl->url);
+  if (dl->conditional)
+    download_add_validators (dl, job->msg);
+  if (job->offset > 0)
+    soup_message_headers_set_range (job->msg->request_headers, job->offset, -1);
+
+  job->started = g_get_monotonic_time ();
+  soup_session_send_async (job->queue->session, job->msg, NULL, download_sent_cb, job);
+}
+
+static void
+download_start_next (DownloadQueue *queue)
+{
+  Download *dl = g_queue_pop_head (&queue->pending);
+  if (!dl)
+    return;
+
+  DownloadJob *job = download_job_new (queue, dl);
+  queue->running++;
+
+  g_autoptr(SoupURI) parsed = soup_uri_new (dl->url);
+  if (!SOUP_URI_VALID_FOR_HTTP (parsed))
+    {
+      /* Local files are copied synchronously, but still chunk by chunk so
+       * the checksum is verified the same way. */
+      g_autoptr(GFile) local = g_file_new_for_path (dl->url);
+      job->istream = G_INPUT_STREAM (g_file_read (local, NULL, &dl->error));
+      if (job->istream && download_job_open (job, FALSE))
+        {
+          gssize len;
+          while ((len = g_input_stream_read (job->istream, job->buf, sizeof (job->buf),
+                                             NULL, &dl->error)) > 0)
+            if (!download_job_write (job, len))
+              break;
+          if (len == 0)
+            download_job_verify (job);
+        }
+      download_job_finish (job);
+      return;
+    }
+
+  if (!queue->session)
+    {
+      g_set_error (&dl->error,
+                   G_OPTION_ERROR, G_OPTION_ERROR_FAILED,
+                   "Network access is disabled");
+      download_job_finish (job);
+      return;
+    }
+
+  g_debug ("Downloading %s to %s", dl->url, dl->path);
+
+  download_job_send (job);
+}
+
+/**
+ * download_all:
+ * @session: session used for all the requests, or %NULL to only allow
+ *   local files
+ * @downloads: array of #Download to process
+ * @max_parallel: maximum number of transfers running at the same time
+ *
+ * Run all @downloads concurrently and return once all of them have finished.
+ * Failures are reported in the error field of each #Download.
+ */
+void
+download_all (SoupSession *session,
+              GPtrArray   *downloads,
+              guint        max_parallel)
+{
+  DownloadQueue queue = { 0 };
+  queue.session = session;
+  g_queue_init (&queue.pending);
+  for (unsigned int i = 0; i < downloads->len; i++)
+    g_queue_push_tail (&queue.pending, g_ptr_array_index (downloads, i));
+
+  /* Async operations of the session are dispatched in the thread-default
+   * context, so use a private one to not run anything else meanwhile. */
+  GMainContext *context = g_main_context_new ();
+  g_main_context_push_thread_default (context);
+
+  for (guint i = 0; i < MAX (max_parallel, 1); i++)
+    download_start_next (&queue);
+
+  while (queue.running)
+    g_main_context_iteration (context, TRUE);
+
+  g_main_context_pop_thread_default (context);
+  g_main_context_unref (context);
+}
+
+/* Run a single download, which stays owned by the caller */
+gboolean
+download_run (SoupSession  *session,
+              Download     *dl,
+              GError      **error)
+{
+  g_autoptr(GPtrArray) downloads = g_ptr_array_new ();
+  g_ptr_array_add (downloads, dl);
+
+  download_all (session, downloads, 1);
+  if (dl->error)
+    {
+      g_propagate_error (error, g_steal_pointer (&dl->error));
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+/**
+ * download_zck:
+ * @session: session used for the requests
+ * @dl: the download, with the checksum of the file set
+ * @seed: path of an older version of the file
+ * @error: return location for a #GError
+ *
+ * Download @dl incrementally with zck_download(), from its URL and then
+ * from each of its mirrors until one succeeds. On failure, @dl is left as
+ * it was, for a full download to start over from its URL.
+ *
+ * Returns: %FALSE on failure, in which case a full download should be tried
+ */
+gboolean
+download_zck (SoupSession  *session,
+              Download     *dl,
+              const char   *seed,
+              GError      **error)
+{
+  g_autofree gchar *url = g_strdup (dl->url);
+  gint mirror = dl->mirror;
+  Id chksumtype = solv_chksum_get_type (dl->expected);
+  const unsigned char *chksum = solv_chksum_get (dl->expected, NULL);
+
+  for (;;)
+    {
+      g_autoptr(GError) e = NULL;
+      if (zck_download (session, dl->url, dl->path, seed, chksumtype, chksum, &e))
+        return TRUE;
+
+      g_autofree gchar *failed = g_strdup (dl->url);
+      if (!download_next_mirror (dl))
+        {
+          g_propagate_error (error, g_steal_pointer (&e));
+          break;
+        }
+      g_debug ("Could not download %s incrementally: %s", failed, e->message);
+    }
+
+  g_free (dl->url);
+  dl->url = g_steal_pointer (&url);
+  dl->mirror = mirror;
+  return FALSE;
+}
+
+gboolean
+download_to_path (SoupSession          *session,
+                  const char           *url,
+                  const char           *path,
+                  Id                    chksumtype,
+                  const unsigned char  *chksum,
+                  GError              **error)
+{
+  g_autoptr(Download) dl = download_new (url, path);
+  download_set_checksum (dl, chksumtype, chksum);
+
+  return download_run (session, dl, error);
+}
+
+struct _DownloadStream
+{
+  SoupSession *session;
+  Download    *dl;
+  GThread     *thread;
+  FILE        *fp;
+  /* Socket the downloaded data are fed to the reader through */
+  int          fd;
+};
+
+static gboolean
+send_all (int           fd,
+          const guchar *buf,
+          gsize         len)
+{
+  while (len)
+    {
+      ssize_t n = send (fd, buf, len, MSG_NOSIGNAL);
+      if (n < 0)
+        {
+          if (errno == EINTR)
+            continue;
+          return FALSE;
+        }
+      buf += n;
+      len -= n;
+    }
+
+  return TRUE;
+}
+
+static gpointer
+download_stream_thread (gpointer data)
+{
+  DownloadStream *stream = data;
+  Download *dl = stream->dl;
+  gboolean feeding = TRUE;
+
+  DownloadJob *job = download_job_new (NULL, dl);
+
+  g_debug ("Streaming %s to %s", dl->url, dl->path);
+
+  /* What an interrupted run left in the .part file is fed to the reader
+   * first, and the transfer continues after it */
+  if (!download_job_load_part (job, stream->fd))
+    {
+      g_set_error (&dl->error,
+                   G_OPTION_ERROR, G_OPTION_ERROR_FAILED,
+                   "Could not read %s", job->partpath);
+      close (stream->fd);
+      download_job_complete (job);
+      return NULL;
+    }
+
+  /* The reader can't start over, so a broken transfer is continued where it
+   * stopped. Servers which don't support that send everything again, and
+   * what the reader already got is skipped. */
+  for (;;)
+    {
+      gboolean transient = TRUE;
+      gboolean resuming = job->offset > 0;
+      goffset skip = 0;
+
+      job->msg = soup_message_new ("GET", dl->url);
+      if (resuming)
+        soup_message_headers_set_range (job->msg->request_headers, job->offset, -1);
+
+      job->istream = soup_session_send (stream->session, job->msg, NULL, &dl->error);
+      if (job->istream)
+        {
+          if (resuming && job->msg->status_code != SOUP_STATUS_PARTIAL_CONTENT)
+            skip = job->offset;
+
+          if (!download_job_check_status (job))
+            transient = status_is_transient (job->msg->status_code);
+          else if (!(skip ? download_job_open (job, TRUE) : download_job_open_response (job)))
+            transient = FALSE;
+          else
+            {
+              gssize len;
+              while ((len = g_input_stream_read (job->istream, job->buf, sizeof (job->buf),
+                                                 NULL, &dl->error)) > 0)
+                {
+                  if (skip > 0)
+                    {
+                      gsize skipped = MIN ((goffset) len, skip);
+                      skip -= skipped;
+                      len -= skipped;
+                      memmove (job->buf, job->buf + skipped, len);
+                    }
+                  if (!download_job_write (job, len))
+                    {
+                      transient = FALSE;
+                      break;
+                    }
+                  /* The reader may stop early, keep downloading for the cache anyway */
+                  if (feeding && !send_all (stream->fd, job->buf, len))
+                    feeding = FALSE;
+                }
+              if (len == 0)
+                {
+                  download_job_verify (job);
+                  break;
+                }
+            }
+        }
+
+      job->keep_part = transient;
+      guint delay = DOWNLOAD_RETRY_DELAY_MS << job->attempt;
+      if (!transient || job->attempt + 1 >= download_max_attempts (dl))
+        {
+          g_autofree gchar *failed = g_strdup (dl->url);
+          if (!download_next_mirror (dl))
+            break;
+          g_debug ("Could not download %s: %s", failed, dl->error->message);
+          job->attempt = 0;
+          delay = 0;
+        }
+      else
+        {
+          g_debug ("Retrying %s in %u ms: %s", dl->url, delay, dl->error->message);
+          job->attempt++;
+        }
+      g_clear_error (&dl->error);
+      /* The checksum of what was fed so far carries over */
+      if (job->ostream)
+        g_output_stream_close (job->ostream, NULL, NULL);
+      g_clear_object (&job->ostream);
+      g_clear_object (&job->istream);
+      g_clear_object (&job->msg);
+      g_usleep ((gulong) delay * 1000);
+    }
+
+  /* Let the reader see the end of the data */
+  close (stream->fd);
+
+  download_job_complete (job);
+
+  return NULL;
+}
+
+/**
+ * download_stream_open:
+ * @session: session used for the request
+ * @dl: the download to perform
+ * @error: return location for a #GError
+ *
+ * Start downloading @dl in a separate thread, and return a stream from which
+ * its data can be read, transparently decompressed based on the extension of
+ * @dl's path, while they arrive. The file is written to @dl's path as well.
+ * What an interrupted run left of it is read first, and the transfer
+ * continues after that.
+ *
+ * Returns: the stream, to be closed with download_stream_close()
+ */
+DownloadStream *
+download_stream_open (SoupSession  *session,
+                      Download     *dl,
+                      GError      **error)
+{
+  int fds[2];
+  if (socketpair (AF_UNIX, SOCK_STREAM, 0, fds) == -1)
+    {
+      g_set_error (error,
+                   G_OPTION_ERROR, G_OPTION_ERROR_FAILED,
+                   "Could not create socket: %s", g_strerror (errno));
+      return NULL;
+    }
+
+  FILE *fp = solv_xfopen_fd (dl->path, fds[0], "r");
+  if (!fp)
+    {
+      g_set_error (error,
+                   G_OPTION_ERROR, G_OPTION_ERROR_FAILED,
+                   "Could not open stream for %s", dl->url);
+      close (fds[0]);
+      close (fds[1]);
+      return NULL;
+    }
+
+  DownloadStream *stream = g_new0 (DownloadStream, 1);
+  stream->session = session;
+  stream->dl = dl;
+  stream->fp = fp;
+  stream->fd = fds[1];
+  stream->thread = g_thread_new ("download", download_stream_thread, stream);
+
+  return stream;
+}
+
+FILE *
+download_stream_get_fp (DownloadStream *stream)
+{
+  return stream->fp;
+}
+
+/**
+ * download_stream_close:
+ * @stream: a stream returned by download_stream_open()
+ * @error: return location for a #GError
+ *
+ * Close the stream and wait for the download to finish.
+ *
+ * Returns: %FALSE if the download failed, in which case whatever was read
+ * from the stream should be discarded
+ */
+gboolean
+download_stream_close (DownloadStream  *stream,
+                       GError         **error)
+{
+  Download *dl = stream->dl;
+
+  /* Closing the reading end first makes sure the thread can't block */
+  fclose (stream->fp);
+  g_thread_join (stream->thread);
+  g_free (stream);
+
+  if (dl->error)
+    {
+      g_propagate_error (error, g_error_copy (dl->error));
+      return FALSE;
+    }
+
+  return TRUE;
+}
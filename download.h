@@ -0,0 +1,48 @@
+#pragma once
+
+#include <glib.h>
+#include <libsoup/soup.h>
+#include <solv/chksum.h>
+
+typedef struct
+{
+  char   *url;
+  char   *path;
+  /* Checksum the downloaded data must match, if any */
+  Chksum *expected;
+  /* Only download if changed since the copy at path was fetched */
+  gboolean conditional;
+  /* Set when a conditional download found the copy at path current */
+  gboolean not_modified;
+  /* How many times to try, 0 for the default */
+  guint max_attempts;
+  /* Base URLs of mirrors to fall back to, and path of the file below them */
+  GPtrArray *mirrors;
+  char   *relpath;
+  gint    mirror;
+  /* Time until the response arrived and until the transfer ended, in
+   * microseconds */
+  gint64  latency;
+  gint64  elapsed;
+  GError *error;
+} Download;
+
+Download *download_new (const char *url, const char *path);
+void download_set_checksum (Download *dl, Id chksumtype, const unsigned char *chksum);
+void download_set_mirrors (Download *dl, GPtrArray *mirrors, const char *relpath);
+void download_free (Download *dl);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC(Download, download_free);
+
+void download_all (SoupSession *session, GPtrArray *downloads, guint max_parallel);
+typedef struct _DownloadStream DownloadStream;
+
+DownloadStream *download_stream_open (SoupSession *session, Download *dl, GError **error);
+FILE *download_stream_get_fp (DownloadStream *stream);
+gboolean download_stream_close (DownloadStream *stream, GError **error);
+
+gboolean download_run (SoupSession *session, Download *dl, GError **error);
+gboolean download_zck (SoupSession *session, Download *dl, const char *seed, GError **error);
+gboolean download_to_path (SoupSession *session, const char *url, const char *path, Id chksumtype, const unsigned char *chksum, GError **error);
+
+gboolean zck_download (SoupSession *session, const char *url, const char *path, const char *seed, Id chksumtype, const unsigned char *chksum, GError **error);
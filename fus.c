@@ -1,8 +1,10 @@
 #include "fus.h"
 
+#include <fnmatch.h>
 #include <gio/gio.h>
 #include <solv/policy.h>
 #include <solv/poolarch.h>
+#include <string.h>
 
 static Solver *
 solve (Pool *pool, Queue *jobs)
@@ -228,6 +230,121 @@ apply_excludes (Pool       *pool,
   return excludes;
 }
 
+static gboolean
+solvable_is_modular (Pool *pool, Solvable *s, Id modpkg)
+{
+  if (!modpkg || !s->provides)
+    return FALSE;
+  for (Id *pp = s->repo->idarraydata + s->provides; *pp; pp++)
+    if (*pp == modpkg)
+      return TRUE;
+  return FALSE;
+}
+
+/* Same matching as SELECTION_NAME | SELECTION_GLOB | SELECTION_DOTARCH, which
+ * can't be used before whatprovides exist */
+static gboolean
+exclude_matches (Pool *pool, Solvable *s, const char *exclude)
+{
+  const char *name = pool_id2str (pool, s->name);
+  gboolean source = s->arch == ARCH_SRC || s->arch == ARCH_NOSRC;
+
+  if (!source && fnmatch (exclude, name, 0) == 0)
+    return TRUE;
+
+  const char *dot = strrchr (exclude, '.');
+  if (!dot || g_strcmp0 (dot + 1, pool_id2str (pool, s->arch)) != 0)
+    return FALSE;
+
+  g_autofree gchar *glob = g_strndup (exclude, dot - exclude);
+  return fnmatch (glob, name, 0) == 0;
+}
+
+static void
+free_solvable_run (Pool *pool, Id start, int count)
+{
+  if (count)
+    repo_free_solvable_block (pool_id2solvable (pool, start)->repo, start, count, 1);
+}
+
+/**
+ * prune_pool:
+ * @pool: pool with all repos and file provides loaded, but no whatprovides yet
+ * @exclude_packages: names of packages to be excluded
+ * @lookaside_repos: set of repos that will not have packages excluded
+ *
+ * Drop solvables which can never be part of the result: packages of
+ * architectures incompatible with the pool, and excluded packages. This is
+ * the same as what pool_setarch() and apply_excludes() hide, except that
+ * the solvables are freed rather than masked, so that everything sized by
+ * the number of solvables gets smaller. Source packages are kept since
+ * modules refer to them.
+ */
+static void
+prune_pool (Pool       *pool,
+            GStrv       exclude_packages,
+            GHashTable *lookaside_repos)
+{
+  Id modpkg = pool_str2id (pool, MODPKG_PROV, 0);
+  guint nexcludes = exclude_packages ? g_strv_length (exclude_packages) : 0;
+  g_autofree gboolean *matched = g_new0 (gboolean, nexcludes);
+  int npruned = 0;
+
+  /* Go backwards, so that freeing at the end of the pool actually shrinks
+   * it, and free consecutive solvables of a repo in one go */
+  Id start = 0;
+  int count = 0;
+  for (Id p = pool->nsolvables - 1; p >= 2; p--)
+    {
+      Solvable *s = pool_id2solvable (pool, p);
+      gboolean prune = FALSE;
+
+      if (s->repo && s->repo != pool->installed)
+        {
+          if (s->arch != ARCH_SRC && s->arch != ARCH_NOSRC &&
+              (s->arch > pool->lastarch || !pool->id2arch[s->arch]))
+            prune = TRUE;
+
+          for (guint i = 0; !prune && i < nexcludes; i++)
+            {
+              if (!exclude_matches (pool, s, exclude_packages[i]))
+                continue;
+              matched[i] = TRUE;
+
+              /* Ignore packages from lookaside, and modular packages */
+              if (g_hash_table_contains (lookaside_repos, s->repo) ||
+                  solvable_is_modular (pool, s, modpkg))
+                continue;
+
+              g_info ("Excluding %s (based on %s)",
+                      pool_solvable2str (pool, s),
+                      exclude_packages[i]);
+              prune = TRUE;
+            }
+        }
+
+      if (prune && count && s->repo == pool_id2solvable (pool, start)->repo)
+        {
+          start = p;
+          count++;
+        }
+      else
+        {
+          free_solvable_run (pool, start, count);
+          start = p;
+          count = prune ? 1 : 0;
+        }
+      npruned += prune;
+    }
+  free_solvable_run (pool, start, count);
+
+  for (guint i = 0; i < nexcludes; i++)
+    if (!matched[i])
+      g_warning ("Nothing matches exclude '%s'", exclude_packages[i]);
+
+  g_debug ("Pruned %d solvables, %d left", npruned, pool->nsolvables);
+}
+
 static Map
 precompute_modular_packages (Pool *pool)
 {
@@ -240,6 +357,93 @@ precompute_modular_packages (Pool *pool)
   return modular_pkgs;
 }
 
+/* Packages of each module, found through their module:$n:$s:$v:$c.$a
+ * requires */
+typedef struct
+{
+  /* Start of the packages of each module in @packages, by solvable id */
+  Id *offsets;
+  Id *packages;
+} ModulePackages;
+
+static void
+module_packages_clear (ModulePackages *modpkgs)
+{
+  modpkgs->offsets = solv_free (modpkgs->offsets);
+  modpkgs->packages = solv_free (modpkgs->packages);
+}
+
+G_DEFINE_AUTO_CLEANUP_CLEAR_FUNC(ModulePackages, module_packages_clear);
+
+/**
+ * module_packages_init:
+ * @modpkgs: the index to fill
+ * @pool: pool with whatprovides set up
+ *
+ * Index the modular packages by the modules they require, so that finding the
+ * packages of a module doesn't need going through the requires of the whole
+ * pool. The packages of each module are sorted by solvable id.
+ */
+static void
+module_packages_init (ModulePackages *modpkgs,
+                      Pool           *pool)
+{
+  /* Module followed by one of its packages */
+  g_auto(Queue) pairs;
+  queue_init (&pairs);
+
+  /* Looking up the modules can extend whatprovides, so no pointers into it
+   * are kept */
+  Id p, pp;
+  FOR_PROVIDES (p, pp, pool_str2id (pool, MODPKG_PROV, 1))
+    {
+      Solvable *s = pool_id2solvable (pool, p);
+      if (!s->requires)
+        continue;
+
+      for (Id *rp = s->repo->idarraydata + s->requires; *rp; rp++)
+        {
+          if (!ISRELDEP (*rp))
+            continue;
+          Reldep *rd = GETRELDEP (pool, *rp);
+          if (rd->flags != REL_ARCH)
+            continue;
+          Id name = rd->name, arch = rd->evr;
+
+          Id m, mp;
+          FOR_PROVIDES (m, mp, *rp)
+            {
+              Solvable *module = pool_id2solvable (pool, m);
+              if (module->name == name && module->arch == arch)
+                queue_push2 (&pairs, m, p);
+            }
+        }
+    }
+
+  modpkgs->offsets = solv_calloc (pool->nsolvables + 1, sizeof (Id));
+  modpkgs->packages = solv_calloc (pairs.count / 2 + 1, sizeof (Id));
+  for (int i = 0; i < pairs.count; i += 2)
+    modpkgs->offsets[pairs.elements[i] + 1]++;
+  for (int m = 0; m < pool->nsolvables; m++)
+    modpkgs->offsets[m + 1] += modpkgs->offsets[m];
+
+  /* Filled from the end to keep the order of the pairs */
+  Id *fill = solv_memdup2 (modpkgs->offsets + 1, pool->nsolvables, sizeof (Id));
+  for (int i = pairs.count - 2; i >= 0; i -= 2)
+    modpkgs->packages[--fill[pairs.elements[i]]] = pairs.elements[i + 1];
+  solv_free (fill);
+}
+
+/* Packages of @module, of which there are @count */
+static inline Id *
+module_packages_get (ModulePackages *modpkgs,
+                     Id              module,
+                     int            *count)
+{
+  *count = modpkgs->offsets[module + 1] - modpkgs->offsets[module];
+  return modpkgs->packages + modpkgs->offsets[module];
+}
+
 static gboolean
 _install_transaction (Pool         *pool,
                       Queue        *pile,
@@ -328,6 +532,7 @@ mask_bare_rpms (Pool  *pool,
 /**
  * disable_module:
  * @pool: initialized pool
+ * @modpkgs: packages of each module
  * @module: Id of the module to be disabled
  *
  * Set the module and all packages in it as not considered. The packages would
@@ -336,29 +541,25 @@ mask_bare_rpms (Pool  *pool,
  * packages since we wouldn't really know which modular packages are available.
  */
 static void
-disable_module (Pool *pool, Id module)
+disable_module (Pool           *pool,
+                ModulePackages *modpkgs,
+                Id              module)
 {
   map_clr (pool->considered, module);
 
-  Solvable *s = pool_id2solvable (pool, module);
-  g_auto(Queue) q;
-  queue_init (&q);
-  Id dep = pool_rel2id (pool, s->name, s->arch, REL_ARCH, 1);
-  pool_whatcontainsdep (pool, SOLVABLE_REQUIRES, dep, &q, 0);
-
-  for (int k = 0; k < q.count; k++)
-    {
-      Id p = q.elements[k];
-      map_clr (pool->considered, p);
-    }
+  int count;
+  Id *pkgs = module_packages_get (modpkgs, module, &count);
+  for (int k = 0; k < count; k++)
+    map_clr (pool->considered, pkgs[k]);
 }
 
 static gboolean
-add_module_and_pkgs_to_pile (Pool     *pool,
-                             Queue    *pile,
-                             Map      *tested,
-                             Id        module,
-                             gboolean  with_deps)
+add_module_and_pkgs_to_pile (Pool           *pool,
+                             ModulePackages *modpkgs,
+                             Queue          *pile,
+                             Map            *tested,
+                             Id              module,
+                             gboolean        with_deps)
 {
   gboolean solv_failed = FALSE;
 
@@ -367,17 +568,14 @@ add_module_and_pkgs_to_pile (Pool     *pool,
    */
   queue_pushunique (pile, module);
 
-  g_auto(Queue) q;
-  queue_init (&q);
-  Solvable *s = pool_id2solvable (pool, module);
-  Id dep = pool_rel2id (pool, s->name, s->arch, REL_ARCH, 1);
-  pool_whatcontainsdep (pool, SOLVABLE_REQUIRES, dep, &q, 0);
+  int count;
+  Id *pkgs = module_packages_get (modpkgs, module, &count);
 
   g_auto(Queue) j;
   queue_init (&j);
-  for (int k = 0; k < q.count; k++)
+  for (int k = 0; k < count; k++)
     {
-      Id p = q.elements[k];
+      Id p = pkgs[k];
       /* Add modular package even if it's not installable */
       queue_pushunique (pile, p);
 
@@ -396,9 +594,10 @@ add_module_and_pkgs_to_pile (Pool     *pool,
 }
 
 static gboolean
-resolve_all_solvables (Pool  *pool,
-                       Queue *pile,
-                       Map   *excludes)
+resolve_all_solvables (Pool           *pool,
+                       ModulePackages *modpkgs,
+                       Queue          *pile,
+                       Map            *excludes)
 {
   g_auto(Map) tested;
   map_init (&tested, pool->nsolvables);
@@ -439,7 +638,7 @@ resolve_all_solvables (Pool  *pool,
               /* Disable all non-default unrelated modules */
               Id *pp = pool_whatprovides_ptr (pool, ndef_modules_rel);
               for (; *pp; pp++)
-                disable_module (pool, *pp);
+                disable_module (pool, modpkgs, *pp);
 
               mask_bare_rpms (pool, pile);
 
@@ -455,7 +654,7 @@ resolve_all_solvables (Pool  *pool,
                 {
                   solv_failed = TRUE;
                   /* Add module and its packages even if they have broken deps */
-                  add_module_and_pkgs_to_pile (pool, pile, &tested, p, FALSE);
+                  add_module_and_pkgs_to_pile (pool, modpkgs, pile, &tested, p, FALSE);
                 }
 
               for (unsigned int i = 0; i < transactions->len; i++)
@@ -480,7 +679,7 @@ resolve_all_solvables (Pool  *pool,
                   Id *pp = pool_whatprovides_ptr (pool, ndef_modules_rel);
                   for (; *pp; pp++)
                     if (!queue_contains (&t, *pp))
-                      disable_module (pool, *pp);
+                      disable_module (pool, modpkgs, *pp);
 
                   mask_bare_rpms(pool, pile);
 
@@ -488,6 +687,7 @@ resolve_all_solvables (Pool  *pool,
                   pool->pooljobs = job;
                   for (int j = 0; j < t.count; j++)
                     solv_failed |= add_module_and_pkgs_to_pile (pool,
+                                                                modpkgs,
                                                                 pile,
                                                                 &tested,
                                                                 t.elements[j],
@@ -606,7 +806,8 @@ add_solvables_to_pile (Pool    *pool,
 }
 
 static Queue
-mask_non_default_module_pkgs (Pool *pool)
+mask_non_default_module_pkgs (Pool           *pool,
+                              ModulePackages *modpkgs)
 {
   Queue selection;
   queue_init(&selection);
@@ -619,16 +820,12 @@ mask_non_default_module_pkgs (Pool *pool)
   Id *pp = pool_whatprovides_ptr (pool, ndef_modules_rel);
   for (; *pp; pp++)
     {
-      Solvable *s = pool_id2solvable (pool, *pp);
-      g_auto(Queue) q;
-      queue_init (&q);
-      Id dep = pool_rel2id (pool, s->name, s->arch, REL_ARCH, 1);
-      pool_whatcontainsdep (pool, SOLVABLE_REQUIRES, dep, &q, 0);
-
-      for (int i = 0; i < q.count; i++)
+      int count;
+      Id *pkgs = module_packages_get (modpkgs, *pp, &count);
+      for (int i = 0; i < count; i++)
         selection_make (pool,
                         &selection,
-                        pool_solvid2str (pool, q.elements[i]),
+                        pool_solvid2str (pool, pkgs[i]),
                         SELECTION_CANON | SELECTION_ADD);
     }
 
@@ -639,7 +836,8 @@ mask_non_default_module_pkgs (Pool *pool)
  * Mask bare rpms if any of the default modules provides them (even if older)
  */
 static Queue
-mask_solvable_bare_rpms (Pool *pool)
+mask_solvable_bare_rpms (Pool           *pool,
+                         ModulePackages *modpkgs)
 {
   Queue selection;
   queue_init (&selection);
@@ -653,15 +851,11 @@ mask_solvable_bare_rpms (Pool *pool)
   Id *pp = pool_whatprovides_ptr (pool, def_modules_rel);
   for (; *pp; pp++)
     {
-      Solvable *s = pool_id2solvable (pool, *pp);
-      g_auto(Queue) q;
-      queue_init (&q);
-      Id dep = pool_rel2id (pool, s->name, s->arch, REL_ARCH, 1);
-      pool_whatcontainsdep (pool, SOLVABLE_REQUIRES, dep, &q, 0);
-
-      for (int i = 0; i < q.count; i++)
+      int count;
+      Id *pkgs = module_packages_get (modpkgs, *pp, &count);
+      for (int i = 0; i < count; i++)
         {
-          Solvable *modpkg = pool_id2solvable (pool, q.elements[i]);
+          Solvable *modpkg = pool_id2solvable (pool, pkgs[i]);
           Id bare_rpms_rel = pool_rel2id (pool,
                                           modpkg->name,
                                           pool_str2id (pool, MODPKG_PROV, 1),
@@ -680,62 +874,181 @@ mask_solvable_bare_rpms (Pool *pool)
   return selection;
 }
 
+static inline gboolean
+input_is_comps (const char *input)
+{
+  return g_str_has_prefix (input, "group:") || g_str_has_prefix (input, "category:");
+}
+
+/* Whether any of @solvables, or of the lines of the files given as @FILE,
+ * is a group or a category. Unreadable files are reported when the input is
+ * actually read. */
+static gboolean
+inputs_need_comps (GStrv solvables)
+{
+  for (GStrv solvable = solvables; solvable && *solvable; solvable++)
+    {
+      if (**solvable != '@')
+        {
+          if (input_is_comps (*solvable))
+            return TRUE;
+          continue;
+        }
+
+      g_autofree gchar *contents = NULL;
+      if (!g_file_get_contents (*solvable + 1, &contents, NULL, NULL))
+        continue;
+      g_auto(GStrv) lines = g_strsplit (contents, "\n", -1);
+      for (GStrv line = lines; *line; line++)
+        if (input_is_comps (*line))
+          return TRUE;
+    }
+
+  return FALSE;
+}
+
 GPtrArray *
 fus_depsolve (const char *arch,
               const char *platform,
               const GStrv exclude_packages,
               const GStrv repos,
               const GStrv solvables,
+              const FusOptions *options,
               GError    **error)
 {
+  FusOptions defaults = { .parallel_downloads = DEFAULT_PARALLEL_DOWNLOADS };
+  if (!options)
+    options = &defaults;
+
   g_autoptr(Pool) pool = pool_create ();
-#ifndef FUS_TESTING
-  /* Needed for downloading metadata from remote repos */
-  g_autoptr(SoupSession) session = soup_session_new ();
-  pool_setloadcallback (pool, filelist_loadcb, session);
-#endif
+
+  g_autoptr(GPtrArray) repo_specs = g_ptr_array_new_with_free_func ((GDestroyNotify) g_strfreev);
+  for (GStrv repo = repos; repo && *repo; repo++)
+    g_ptr_array_add (repo_specs, g_strsplit (*repo, ",", 3));
+
+  /* Held while loading repos, which may fill their caches */
+  g_autoptr(GArray) cache_locks = NULL;
+
+  cache_locks = lock_repo_caches (repo_specs, error);
+  if (!cache_locks)
+    return NULL;
+
+  /* Comps are only loaded if the input refers to groups or categories */
+  gboolean with_comps = inputs_need_comps (solvables);
+
+  /* Needed for downloading metadata from remote repos. Without a session
+   * only what is already in the cache (or in local repos) gets used. */
+  g_autoptr(SoupSession) session = NULL;
+  if (!options->cacheonly)
+    session = soup_session_new_with_options (SOUP_SESSION_MAX_CONNS, options->parallel_downloads,
+                                              SOUP_SESSION_MAX_CONNS_PER_HOST, options->parallel_downloads,
+                                              SOUP_SESSION_TIMEOUT, DOWNLOAD_TIMEOUT,
+                                              NULL);
+  if (!resolve_repos_mirrors (session, repo_specs, options, error))
+    return NULL;
+  if (session && !fetch_repos_metadata (session, repo_specs, with_comps, options, error))
+    return NULL;
+  g_auto(FilelistsLoader) loader = { session, options, NULL };
+  pool_setloadcallback (pool, filelist_loadcb, &loader);
 
   pool_setarch (pool, arch);
 
-  Repo *system = create_system_repo (pool, platform, arch);
-  pool_set_installed (pool, system);
+  /* The system repo followed by the repos in the order they were given */
+  g_autoptr(GPtrArray) loaded = g_ptr_array_new ();
+  g_auto(Queue) disconsider;
+  queue_init (&disconsider);
+  g_autofree gchar *snapshot = NULL;
+  gboolean from_snapshot = FALSE;
+  if (options->snapshot)
+    snapshot = pool_snapshot_dir (repo_specs, arch, platform, exclude_packages, with_comps, options);
+  if (snapshot)
+    from_snapshot = pool_snapshot_load (pool, snapshot, repo_specs, loaded, &disconsider);
+
+  if (!from_snapshot)
+    {
+      Repo *system = create_system_repo (pool, platform, arch);
+      g_ptr_array_add (loaded, system);
+      pool_set_installed (pool, system);
+    }
+  else
+    pool_set_installed (pool, g_ptr_array_index (loaded, 0));
 
   g_autoptr(GHashTable) lookaside_repos = g_hash_table_new (g_direct_hash, NULL);
-  g_hash_table_add (lookaside_repos, system);
-  for (GStrv repo = repos; repo && *repo; repo++)
+  g_hash_table_add (lookaside_repos, pool->installed);
+  for (unsigned int i = 0; i < repo_specs->len; i++)
     {
-      g_auto(GStrv) strv = g_strsplit (*repo, ",", 3);
+      GStrv strv = g_ptr_array_index (repo_specs, i);
       Repo *r = NULL;
+      if (from_snapshot)
+        r = g_ptr_array_index (loaded, i + 1);
+      else
+        {
 #ifdef FUS_TESTING
-      r = create_test_repo (pool, strv[0], strv[1], strv[2], error);
-#else
-      r = create_repo (pool, session, strv[0], strv[2], error);
+          /* Most tests use testcase repos, which are single files */
+          if (g_strcmp0 (strv[1], MODULAR_TYPE) != 0 &&
+              !g_file_test (strv[2], G_FILE_TEST_IS_DIR))
+            r = create_test_repo (pool, strv[0], strv[1], strv[2], error);
+          else
 #endif
-      if (!r)
-        return NULL;
+          if (g_strcmp0 (strv[1], MODULAR_TYPE) == 0)
+            r = create_modular_repo (pool, strv[0], strv[2], options, error);
+          else
+            r = create_repo (pool, session, strv[0], strv[2],
+                             g_strcmp0 (strv[1], LOOKASIDE_PROVIDES_TYPE) == 0,
+                             with_comps, options, error);
+          if (!r)
+            return NULL;
+          g_ptr_array_add (loaded, r);
+        }
 
-      if (g_strcmp0 (strv[1], "lookaside") == 0)
+      if (g_strcmp0 (strv[1], "lookaside") == 0 ||
+          g_strcmp0 (strv[1], LOOKASIDE_PROVIDES_TYPE) == 0)
         {
           g_hash_table_add (lookaside_repos, r);
           r->subpriority = 100;
         }
     }
 
+  /* Snapshots have the modular packages and default streams marked already */
+  if (!from_snapshot)
+    {
+      pool_add_module_artifacts (pool, loaded);
+      pool_add_module_defaults (pool, loaded);
+    }
+
   pool_addfileprovides (pool);
+  /* That was the last thing which might load metadata */
+  g_clear_pointer (&cache_locks, g_array_unref);
+
+  /* Freeing solvables leaves holes in the repos, which the filelists loader
+   * can not extend, so this has to wait until the file provides are in */
+  if (options->prune && !from_snapshot)
+    prune_pool (pool, exclude_packages, lookaside_repos);
+
   pool_createwhatprovides (pool);
 
   /* Precompute map of modular packages. */
   g_auto(Map) modular_pkgs = precompute_modular_packages (pool);
+  g_auto(ModulePackages) modpkgs;
+  module_packages_init (&modpkgs, pool);
 
   /* Find out excluded packages */
-  g_auto(Map) excludes = apply_excludes (pool, exclude_packages, lookaside_repos, &modular_pkgs);
+  g_auto(Map) excludes = apply_excludes (pool, options->prune ? NULL : exclude_packages,
+                                         lookaside_repos, &modular_pkgs);
+
+  if (!from_snapshot)
+    {
+      /* Find packages from non-default modules */
+      g_auto(Queue) non_default = mask_non_default_module_pkgs (pool, &modpkgs);
+      selection_add (pool, &disconsider, &non_default);
 
-  /* Find packages from non-default modules */
-  g_auto(Queue) disconsider = mask_non_default_module_pkgs (pool);
+      /* Find bare rpms masked by default modules */
+      g_auto(Queue) bare_rpms = mask_solvable_bare_rpms (pool, &modpkgs);
+      selection_add (pool, &disconsider, &bare_rpms);
 
-  /* Find bare rpms masked by default modules */
-  g_auto(Queue) bare_rpms = mask_solvable_bare_rpms (pool);
-  selection_add (pool, &disconsider, &bare_rpms);
+      if (snapshot)
+        pool_snapshot_write (snapshot, loaded, &disconsider, options);
+    }
 
   g_auto(Map) considered;
   pool->considered = &considered;
@@ -753,7 +1066,7 @@ fus_depsolve (const char *arch,
       return NULL;
     }
 
-  gboolean solv_failed = resolve_all_solvables (pool, &pile, &excludes);
+  gboolean solv_failed = resolve_all_solvables (pool, &modpkgs, &pile, &excludes);
   if (solv_failed)
     g_warning ("Can't resolve all solvables");
 
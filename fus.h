@@ -12,15 +12,74 @@
 #define TMPL_NSPROV "module(%s:%s)"
 #define MODPKG_PROV "modular-package()"
 
+/* Lookaside repo of which only what is needed to satisfy dependencies is
+ * loaded */
+#define LOOKASIDE_PROVIDES_TYPE "lookaside-provides"
+/* Repo which is only a modulemd file */
+#define MODULAR_TYPE "modular"
+
+#define DEFAULT_PARALLEL_DOWNLOADS 4
+/* Seconds without progress after which a transfer is considered stalled */
+#define DOWNLOAD_TIMEOUT 30
+
 G_DEFINE_AUTOPTR_CLEANUP_FUNC(Pool, pool_free);
 G_DEFINE_AUTOPTR_CLEANUP_FUNC(Solver, solver_free);
 G_DEFINE_AUTOPTR_CLEANUP_FUNC(Transaction, transaction_free);
 G_DEFINE_AUTO_CLEANUP_CLEAR_FUNC(Queue, queue_free);
 G_DEFINE_AUTO_CLEANUP_CLEAR_FUNC(Map, map_free);
 
-Repo *create_repo (Pool *pool, SoupSession *session, const char *name, const char *path, GError **error);
+typedef struct
+{
+  /* Maximum number of metadata downloads running at the same time */
+  guint parallel_downloads;
+  /* Seconds for which a downloaded repomd.xml is used without checking
+   * whether it changed */
+  gint metadata_expire;
+  /* Only use cached metadata, never touch the network */
+  gboolean cacheonly;
+  /* Parse primary metadata while downloading them */
+  gboolean stream_metadata;
+  /* Drop packages of other architectures and excluded packages from the
+   * pool instead of only hiding them */
+  gboolean prune;
+  /* Load complete filelists rather than only the files depended on */
+  gboolean full_filelists;
+  /* Bytes the cache of each repo is trimmed to after loading it, if set */
+  guint64 cache_max_size;
+  /* Seconds after which unused cached files are removed, if set */
+  gint64 cache_max_age;
+  /* Save the fully loaded pool, and load it instead of the repos when
+   * nothing changed */
+  gboolean snapshot;
+} FusOptions;
+
+/* Data for filelist_loadcb */
+typedef struct
+{
+  SoupSession      *session;
+  const FusOptions *options;
+  /* Paths of files depended on in the pool, collected on first use */
+  GHashTable       *file_deps;
+} FilelistsLoader;
+
+void filelists_loader_clear (FilelistsLoader *loader);
+G_DEFINE_AUTO_CLEANUP_CLEAR_FUNC(FilelistsLoader, filelists_loader_clear);
+
+GArray *lock_repo_caches (GPtrArray *repos, GError **error);
+gboolean resolve_repos_mirrors (SoupSession *session, GPtrArray *repos, const FusOptions *options, GError **error);
+gboolean fetch_repos_metadata (SoupSession *session, GPtrArray *repos, gboolean with_comps, const FusOptions *options, GError **error);
+Repo *create_repo (Pool *pool, SoupSession *session, const char *name, const char *path, gboolean provides_only, gboolean with_comps, const FusOptions *options, GError **error);
+Repo *create_modular_repo (Pool *pool, const char *name, const char *path, const FusOptions *options, GError **error);
+gchar *pool_snapshot_dir (GPtrArray *repos, const char *arch, const char *platform, GStrv exclude_packages, gboolean with_comps, const FusOptions *options);
+gboolean pool_snapshot_load (Pool *pool, const char *dir, GPtrArray *repos, GPtrArray *loaded, Queue *masks);
+void pool_snapshot_write (const char *dir, GPtrArray *loaded, Queue *masks, const FusOptions *options);
 Repo *create_test_repo (Pool *pool, const char *name, const char *type, const char *path, GError **error);
+#ifdef FUS_TESTING
+extern gsize modulemd_chunk_size;
+#endif
 Repo *create_system_repo (Pool *pool, const char *platform, const char *arch);
+void pool_add_module_artifacts (Pool *pool, GPtrArray *repos);
+void pool_add_module_defaults (Pool *pool, GPtrArray *repos);
 int filelist_loadcb (Pool *pool, Repodata *data, void *cdata);
 
-GPtrArray *fus_depsolve (const char *arch, const char *platform, const GStrv exclude_packages, const GStrv repos, const GStrv solvables, GError **error);
+GPtrArray *fus_depsolve (const char *arch, const char *platform, const GStrv exclude_packages, const GStrv repos, const GStrv solvables, const FusOptions *options, GError **error);
@@ -31,12 +31,30 @@ main (int   argc,
   GStrv static repos = NULL;
   GStrv static exclude_packages = NULL;
   static gboolean verbose = FALSE;
+  static gint parallel_downloads = DEFAULT_PARALLEL_DOWNLOADS;
+  static gint metadata_expire = 0;
+  static gboolean cacheonly = FALSE;
+  static gboolean stream_metadata = FALSE;
+  static gboolean prune = FALSE;
+  static gboolean full_filelists = FALSE;
+  static gint cache_max_size = 0;
+  static gint cache_max_age = 0;
+  static gboolean snapshot = FALSE;
   static const GOptionEntry opts[] = {
     { "verbose", 'v', 0, G_OPTION_ARG_NONE, &verbose, "Show extra debugging information", NULL },
     { "arch", 'a', 0, G_OPTION_ARG_STRING, &arch, "Architecture to work with", "ARCH" },
     { "repo", 'r', 0, G_OPTION_ARG_STRING_ARRAY, &repos, "Information about repo (id,type,path)", "REPO" },
     { "platform", 'p', 0, G_OPTION_ARG_STRING, &platform, "Emulate this stream of a platform", "STREAM" },
     { "exclude", 0, 0, G_OPTION_ARG_STRING_ARRAY, &exclude_packages, "Exclude this package", "NAME" },
+    { "parallel-downloads", 0, 0, G_OPTION_ARG_INT, &parallel_downloads, "Maximum number of concurrent metadata downloads", "N" },
+    { "metadata-expire", 0, 0, G_OPTION_ARG_INT, &metadata_expire, "Use downloaded repo metadata for this long without checking for updates", "SECONDS" },
+    { "cacheonly", 'C', 0, G_OPTION_ARG_NONE, &cacheonly, "Only use cached metadata, never access the network", NULL },
+    { "stream-metadata", 0, 0, G_OPTION_ARG_NONE, &stream_metadata, "Parse primary metadata while downloading them", NULL },
+    { "prune", 0, 0, G_OPTION_ARG_NONE, &prune, "Drop packages of other architectures and excluded packages when loading repos", NULL },
+    { "full-filelists", 0, 0, G_OPTION_ARG_NONE, &full_filelists, "Load complete filelists instead of only the files packages depend on", NULL },
+    { "cache-max-size", 0, 0, G_OPTION_ARG_INT, &cache_max_size, "Remove least recently used files from the cache of each repo beyond this size", "MIB" },
+    { "cache-max-age", 0, 0, G_OPTION_ARG_INT, &cache_max_age, "Remove files unused for this long from the cache", "DAYS" },
+    { "snapshot", 0, 0, G_OPTION_ARG_NONE, &snapshot, "Cache the fully loaded pool and reuse it while the repos don't change", NULL },
     { G_OPTION_REMAINING, 0, 0, G_OPTION_ARG_STRING_ARRAY, &solvables, "Things to resolve", "SOLVABLE…" },
     { NULL }
   };
@@ -65,8 +83,36 @@ main (int   argc,
     }
   g_debug ("Setting architecture to %s", arch);
 
+  if (parallel_downloads < 1)
+    {
+      g_set_error_literal (&err,
+                           G_OPTION_ERROR, G_OPTION_ERROR_BAD_VALUE,
+                           "At least one parallel download should be allowed");
+      exiterr (err);
+    }
+
+  if (cache_max_size < 0 || cache_max_age < 0)
+    {
+      g_set_error_literal (&err,
+                           G_OPTION_ERROR, G_OPTION_ERROR_BAD_VALUE,
+                           "Cache limits can't be negative");
+      exiterr (err);
+    }
+
+  FusOptions options = {
+    .parallel_downloads = parallel_downloads,
+    .metadata_expire = metadata_expire,
+    .cacheonly = cacheonly,
+    .stream_metadata = stream_metadata,
+    .prune = prune,
+    .full_filelists = full_filelists,
+    .cache_max_size = (guint64) cache_max_size * 1024 * 1024,
+    .cache_max_age = (gint64) cache_max_age * 24 * 60 * 60,
+    .snapshot = snapshot,
+  };
+
   g_autoptr(GPtrArray) packages = NULL;
-  packages = fus_depsolve (arch, platform, exclude_packages, repos, solvables, &err);
+  packages = fus_depsolve (arch, platform, exclude_packages, repos, solvables, &options, &err);
   if (!packages || err)
     exiterr (err);
 
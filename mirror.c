@@ -0,0 +1,294 @@
+#include "mirror.h"
+#include "download.h"
+
+#include <glib/gstdio.h>
+#include <string.h>
+
+/* Only the first few mirrors are probed, the order of the others is kept */
+#define MIRRORS_PROBE_MAX 8
+/* Mirrors are compared by the time they would take to send this much */
+#define MIRRORS_REFERENCE_SIZE (256 * 1024)
+
+#define REPOMD_SUFFIX "/repodata/repomd.xml"
+
+gboolean
+mirrors_spec_is_list (const char *path)
+{
+  return g_str_has_prefix (path, MIRRORLIST_PREFIX) ||
+         g_str_has_prefix (path, METALINK_PREFIX);
+}
+
+/* Add @url as a base URL, dropping what follows the repo root */
+static void
+mirrors_add (GPtrArray  *mirrors,
+             const char *url)
+{
+  g_autofree gchar *base = g_strstrip (g_strdup (url));
+
+  if (g_str_has_suffix (base, REPOMD_SUFFIX))
+    base[strlen (base) - strlen (REPOMD_SUFFIX)] = '\0';
+  while (g_str_has_suffix (base, "/"))
+    base[strlen (base) - 1] = '\0';
+
+  g_autoptr(SoupURI) uri = soup_uri_new (base);
+  if (!SOUP_URI_VALID_FOR_HTTP (uri))
+    return;
+
+  for (unsigned int i = 0; i < mirrors->len; i++)
+    if (g_strcmp0 (g_ptr_array_index (mirrors, i), base) == 0)
+      return;
+
+  g_ptr_array_add (mirrors, g_steal_pointer (&base));
+}
+
+typedef struct
+{
+  GPtrArray *mirrors;
+  GString   *url;
+} MetalinkParser;
+
+static void
+metalink_start_element (GMarkupParseContext  *context,
+                        const gchar          *element_name,
+                        const gchar         **attribute_names,
+                        const gchar         **attribute_values,
+                        gpointer              user_data,
+                        GError              **error)
+{
+  MetalinkParser *parser = user_data;
+
+  if (g_strcmp0 (element_name, "url") != 0)
+    return;
+
+  for (unsigned int i = 0; attribute_names[i]; i++)
+    if (g_strcmp0 (attribute_names[i], "protocol") == 0 &&
+        g_strcmp0 (attribute_values[i], "http") != 0 &&
+        g_strcmp0 (attribute_values[i], "https") != 0)
+      return;
+
+  parser->url = g_string_new (NULL);
+}
+
+static void
+metalink_end_element (GMarkupParseContext  *context,
+                      const gchar          *element_name,
+                      gpointer              user_data,
+                      GError              **error)
+{
+  MetalinkParser *parser = user_data;
+
+  if (!parser->url || g_strcmp0 (element_name, "url") != 0)
+    return;
+
+  mirrors_add (parser->mirrors, parser->url->str);
+  g_string_free (parser->url, TRUE);
+  parser->url = NULL;
+}
+
+static void
+metalink_text (GMarkupParseContext  *context,
+               const gchar          *text,
+               gsize                 text_len,
+               gpointer              user_data,
+               GError              **error)
+{
+  MetalinkParser *parser = user_data;
+
+  if (parser->url)
+    g_string_append_len (parser->url, text, text_len);
+}
+
+static gboolean
+parse_metalink (GPtrArray   *mirrors,
+                const char  *contents,
+                gsize        len,
+                GError     **error)
+{
+  const GMarkupParser callbacks = {
+    .start_element = metalink_start_element,
+    .end_element = metalink_end_element,
+    .text = metalink_text,
+  };
+  MetalinkParser parser = { mirrors, NULL };
+
+  GMarkupParseContext *context = g_markup_parse_context_new (&callbacks, 0, &parser, NULL);
+  gboolean ret = g_markup_parse_context_parse (context, contents, len, error) &&
+                 g_markup_parse_context_end_parse (context, error);
+  g_markup_parse_context_free (context);
+  if (parser.url)
+    g_string_free (parser.url, TRUE);
+
+  return ret;
+}
+
+/**
+ * mirrors_parse:
+ * @spec: the repo path, starting with either %MIRRORLIST_PREFIX or
+ *   %METALINK_PREFIX
+ * @contents: contents of the mirror list or metalink
+ * @len: length of @contents
+ * @error: return location for a #GError
+ *
+ * Get the base URLs of the HTTP mirrors listed in @contents, in the order
+ * they are listed.
+ *
+ * Returns: (transfer full): array of URLs, or %NULL if none could be found
+ */
+GPtrArray *
+mirrors_parse (const char  *spec,
+               const char  *contents,
+               gsize        len,
+               GError     **error)
+{
+  g_autoptr(GPtrArray) mirrors = g_ptr_array_new_with_free_func (g_free);
+
+  if (g_str_has_prefix (spec, METALINK_PREFIX))
+    {
+      if (!parse_metalink (mirrors, contents, len, error))
+        return NULL;
+    }
+  else
+    {
+      g_autofree gchar *text = g_strndup (contents, len);
+      g_auto(GStrv) lines = g_strsplit (text, "\n", -1);
+      for (GStrv line = lines; *line; line++)
+        if (**line != '#')
+          mirrors_add (mirrors, *line);
+    }
+
+  if (mirrors->len == 0)
+    {
+      g_set_error (error,
+                   G_OPTION_ERROR, G_OPTION_ERROR_FAILED,
+                   "No usable mirrors found");
+      return NULL;
+    }
+
+  return g_steal_pointer (&mirrors);
+}
+
+typedef struct
+{
+  char   *url;
+  /* Estimated time to download a file of the reference size, in
+   * microseconds */
+  gint64  score;
+  guint   index;
+} MirrorRank;
+
+static gint
+mirror_rank_compare (gconstpointer a,
+                     gconstpointer b)
+{
+  const MirrorRank *ra = a, *rb = b;
+
+  if (ra->score != rb->score)
+    return ra->score < rb->score ? -1 : 1;
+  return ra->index < rb->index ? -1 : ra->index > rb->index;
+}
+
+/**
+ * mirrors_rank:
+ * @session: session used for probing
+ * @mirrors: array of base URLs, sorted in place
+ * @max_parallel: maximum number of probes running at the same time
+ * @tmpdir: directory to temporarily store probed files in
+ *
+ * Fetch repomd.xml from the first mirrors and sort them by how long they
+ * would take to send a metadata file, estimated from the response latency
+ * and the throughput. Mirrors which failed come last, but are kept as a last
+ * resort.
+ */
+void
+mirrors_rank (SoupSession *session,
+              GPtrArray   *mirrors,
+              guint        max_parallel,
+              const char  *tmpdir)
+{
+  g_autoptr(GPtrArray) probes = g_ptr_array_new_with_free_func ((GDestroyNotify) download_free);
+  guint nprobes = MIN (mirrors->len, MIRRORS_PROBE_MAX);
+
+  for (guint i = 0; i < nprobes; i++)
+    {
+      g_autofree gchar *url = g_strconcat (g_ptr_array_index (mirrors, i), REPOMD_SUFFIX, NULL);
+      g_autofree gchar *name = g_strdup_printf ("probe-%u.xml", i);
+      g_autofree gchar *path = g_build_filename (tmpdir, name, NULL);
+      Download *dl = download_new (url, path);
+      /* A mirror which doesn't answer right away is not worth waiting for */
+      dl->max_attempts = 1;
+      g_ptr_array_add (probes, dl);
+    }
+
+  download_all (session, probes, max_parallel);
+
+  g_autoptr(GArray) ranks = g_array_sized_new (FALSE, FALSE, sizeof (MirrorRank), mirrors->len);
+  for (guint i = 0; i < mirrors->len; i++)
+    {
+      /* Mirrors which weren't probed go after the working ones, in their
+       * original order, but before the failed ones */
+      MirrorRank rank = { g_ptr_array_index (mirrors, i), G_MAXINT64 - 1, i };
+
+      if (i < nprobes)
+        {
+          rank.score = G_MAXINT64;
+          Download *dl = g_ptr_array_index (probes, i);
+          GStatBuf st;
+          if (!dl->error && g_stat (dl->path, &st) == 0)
+            {
+              gint64 transfer = MAX (dl->elapsed - dl->latency, 1);
+              rank.score = dl->latency + transfer * MIRRORS_REFERENCE_SIZE / MAX (st.st_size, 1);
+              g_debug ("Mirror %s: latency %" G_GINT64_FORMAT " us, %" G_GINT64_FORMAT " bytes/s",
+                       rank.url, dl->latency, (gint64) st.st_size * G_USEC_PER_SEC / transfer);
+            }
+          else
+            g_debug ("Mirror %s failed: %s", rank.url,
+                     dl->error ? dl->error->message : "no data");
+          g_unlink (dl->path);
+        }
+
+      g_array_append_val (ranks, rank);
+    }
+
+  g_array_sort (ranks, mirror_rank_compare);
+
+  /* The array owns the URLs, so just reorder them */
+  for (guint i = 0; i < ranks->len; i++)
+    g_ptr_array_index (mirrors, i) = g_array_index (ranks, MirrorRank, i).url;
+}
+
+/**
+ * mirrors_load:
+ * @path: file previously written by mirrors_save()
+ *
+ * Returns: (transfer full): the saved mirrors, or %NULL if there are none
+ */
+GPtrArray *
+mirrors_load (const char *path)
+{
+  g_autofree gchar *contents = NULL;
+  if (!g_file_get_contents (path, &contents, NULL, NULL))
+    return NULL;
+
+  g_autoptr(GPtrArray) mirrors = g_ptr_array_new_with_free_func (g_free);
+  g_auto(GStrv) lines = g_strsplit (contents, "\n", -1);
+  for (GStrv line = lines; *line; line++)
+    if (**line)
+      g_ptr_array_add (mirrors, g_strdup (*line));
+
+  if (mirrors->len == 0)
+    return NULL;
+
+  return g_steal_pointer (&mirrors);
+}
+
+gboolean
+mirrors_save (const char  *path,
+              GPtrArray   *mirrors,
+              GError     **error)
+{
+  g_autoptr(GString) contents = g_string_new (NULL);
+  for (unsigned int i = 0; i < mirrors->len; i++)
+    g_string_append_printf (contents, "%s\n", (const char *) g_ptr_array_index (mirrors, i));
+
+  return g_file_set_contents (path, contents->str, contents->len, error);
+}
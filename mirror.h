@@ -0,0 +1,14 @@
+#pragma once
+
+#include <glib.h>
+#include <libsoup/soup.h>
+
+#define MIRRORLIST_PREFIX "mirrorlist="
+#define METALINK_PREFIX "metalink="
+
+gboolean mirrors_spec_is_list (const char *path);
+GPtrArray *mirrors_parse (const char *spec, const char *contents, gsize len, GError **error);
+void mirrors_rank (SoupSession *session, GPtrArray *mirrors, guint max_parallel, const char *tmpdir);
+
+GPtrArray *mirrors_load (const char *path);
+gboolean mirrors_save (const char *path, GPtrArray *mirrors, GError **error);
@@ -1,8 +1,13 @@
 #include "fus.h"
+#include "cache.h"
+#include "download.h"
+#include "mirror.h"
 
 #include <errno.h>
+#include <glib/gstdio.h>
 #include <modulemd.h>
 #include <solv/chksum.h>
+#include <solv/hash.h>
 #include <solv/repo_comps.h>
 #include <solv/repo_repomdxml.h>
 #include <solv/repo_rpmmd.h>
@@ -10,7 +15,10 @@
 #include <solv/repo_write.h>
 #include <solv/solv_xfopen.h>
 #include <solv/testcase.h>
+#include <solv/util.h>
 #include <stdint.h>
+#include <string.h>
+#include <unistd.h>
 
 static inline Id
 dep_or_rel (Pool *pool, Id dep, Id rel, Id op)
@@ -118,35 +126,41 @@ add_module_dependencies (Pool      *pool,
   solvable_add_deparray (solvable, SOLVABLE_REQUIRES, requires, 0);
 }
 
+/* Name of the key under which the rpm artifacts of module solvables are
+ * stored until pool_add_module_artifacts matches them to packages */
+#define ARTIFACTS_KEY "fus:artifacts"
+
+/* Name of the repo key under which the default streams of modules are
+ * stored, as module($n:$s), until pool_add_module_defaults marks them */
+#define DEFAULTS_KEY "fus:defaults"
+
 static void
-add_artifacts_dependencies (Pool  *pool,
-                            Queue *sel,
-                            Id     sdep)
+add_artifacts_dependencies (Pool     *pool,
+                            Solvable *s,
+                            Solvable *module)
 {
-  g_auto(Queue) rpms;
-  queue_init (&rpms);
-  selection_solvables (pool, sel, &rpms);
-  for (int i = 0; i < rpms.count; i++)
-    {
-      Solvable *s = pool_id2solvable (pool, rpms.elements[i]);
-
-      /* Req: module:$n:$s:$v:$c . $a */
-      solvable_add_deparray (s, SOLVABLE_REQUIRES, sdep, 0);
+  /* Req: module:$n:$s:$v:$c . $a */
+  Id sdep = pool_rel2id (pool, module->name, module->arch, REL_ARCH, 1);
+  solvable_add_deparray (s, SOLVABLE_REQUIRES, sdep, 0);
 
-      /* Prv: modular-package() */
-      Id modpkg = pool_str2id (pool, MODPKG_PROV, 1);
-      solvable_add_deparray (s, SOLVABLE_PROVIDES, modpkg, 0);
-    }
+  /* Prv: modular-package() */
+  Id modpkg = pool_str2id (pool, MODPKG_PROV, 1);
+  solvable_add_deparray (s, SOLVABLE_PROVIDES, modpkg, 0);
 }
 
+/*
+ * Record the rpm artifacts of @module on the solvable @p as "$n.$a = $evr"
+ * dependencies. The packages may well not be loaded yet, so they are only
+ * matched once all repos are in.
+ */
 static void
-add_module_rpm_artifacts (Pool                   *pool,
-                          ModulemdModuleStreamV2 *module,
-                          Id                      sdep)
+add_module_rpm_artifacts (Repodata               *data,
+                          Id                      p,
+                          ModulemdModuleStreamV2 *module)
 {
+  Pool *pool = data->repo->pool;
+  Id key = pool_str2id (pool, ARTIFACTS_KEY, 1);
   g_auto(GStrv) rpm_artifacts = modulemd_module_stream_v2_get_rpm_artifacts_as_strv (module);
-  g_auto(Queue) sel;
-  queue_init (&sel);
   for (GStrv artifact = rpm_artifacts; *artifact; artifact++)
     {
       const char *nevra = *artifact;
@@ -180,29 +194,25 @@ add_module_rpm_artifacts (Pool                   *pool,
           !arch_delimiter || arch_delimiter <= rel_delimiter + 1 || arch_delimiter == end - 1)
         continue;
 
-      Id nid, evrid, aid;
-      if (!(nid = pool_strn2id (pool, nevra, name_len, 0)))
-        continue;
+      Id nid = pool_strn2id (pool, nevra, name_len, 1);
       evr_delimiter++;
-      if (!(evrid = pool_strn2id (pool, evr_delimiter, arch_delimiter - evr_delimiter, 0)))
-        continue;
+      Id evrid = pool_strn2id (pool, evr_delimiter, arch_delimiter - evr_delimiter, 1);
       arch_delimiter++;
-      if (!(aid = pool_strn2id (pool, arch_delimiter, end - arch_delimiter, 0)))
-        continue;
+      Id aid = pool_strn2id (pool, arch_delimiter, end - arch_delimiter, 1);
 
       /* $n.$a = $evr */
       Id rid = pool_rel2id (pool, nid, aid, REL_ARCH, 1);
       rid = pool_rel2id (pool, rid, evrid, REL_EQ, 1);
 
-      queue_push2 (&sel, SOLVER_SOLVABLE_NAME | SOLVER_SETEVR | SOLVER_SETARCH, rid);
+      repodata_add_idarray (data, p, key, rid);
     }
-
-  add_artifacts_dependencies (pool, &sel, sdep);
 }
 
 /* TODO: implement usage of REPO_EXTEND_SOLVABLES, but modulemd doesn't store chksums */
-static void
+/* Returns the module solvable, if the module is a built one */
+static Id
 add_module_solvables (Repo                 *repo,
+                      Repodata             *data,
                       ModulemdModuleStream *module)
 {
   Pool *pool = repo->pool;
@@ -219,6 +229,7 @@ add_module_solvables (Repo                 *repo,
     a = "noarch";
 
   GPtrArray *deps = modulemd_module_stream_v2_get_dependencies ((ModulemdModuleStreamV2 *) module);
+  Id p = 0;
 
   /* If context is defined, then it's built artefact */
   if (c)
@@ -258,13 +269,9 @@ add_module_solvables (Repo                 *repo,
                              0);
 
       add_module_dependencies (pool, solvable, deps);
-#ifdef FUS_TESTING
-      /* This is needed when running tests because add_module_rpm_artifacts
-       * relies on provides being created
-       */
-      pool_createwhatprovides (pool);
-#endif
-      add_module_rpm_artifacts (pool, (ModulemdModuleStreamV2 *) module, sdep);
+      p = pool_solvable2id (pool, solvable);
+      if (data)
+        add_module_rpm_artifacts (data, p, (ModulemdModuleStreamV2 *) module);
     }
 
   /* Add source packages */
@@ -275,6 +282,8 @@ add_module_solvables (Repo                 *repo,
 
       add_source_package (repo, req, name);
     }
+
+  return p;
 }
 
 /**
@@ -287,6 +296,7 @@ add_module_solvables (Repo                 *repo,
  */
 static void
 _repo_add_modulemd_streams (Repo       *repo,
+                            Repodata   *data,
                             GPtrArray  *streams)
 {
   guint64 latest_version = modulemd_module_stream_get_version(g_ptr_array_index (streams, 0));
@@ -296,265 +306,1233 @@ _repo_add_modulemd_streams (Repo       *repo,
       ModulemdModuleStream *stream = g_ptr_array_index (streams, i);
       if (modulemd_module_stream_get_version (stream) != latest_version)
         break;
-      add_module_solvables (repo, g_ptr_array_index (streams, i));
+      add_module_solvables (repo, data, g_ptr_array_index (streams, i));
     }
+}
 
-  pool_createwhatprovides (repo->pool);
+/* Mark the module solvables of default streams */
+static void
+_repo_add_modulemd_defaults (Pool  *pool,
+                             Queue *solvables)
+{
+  for (int i = 0; i < solvables->count; i++)
+    {
+      Solvable *s = pool_id2solvable (pool, solvables->elements[i]);
+      solvable_add_deparray (s, SOLVABLE_PROVIDES,
+                             pool_str2id (pool, "module-default()", 1),
+                             0);
+    }
 }
 
+/* Size of the pieces modules.yaml is read in to be parsed on their own.
+ * Tests make it smaller, to get more than one out of small files. */
+#ifdef FUS_TESTING
+gsize modulemd_chunk_size = 256 * 1024;
+#define MODULEMD_CHUNK_SIZE modulemd_chunk_size
+#else
+#define MODULEMD_CHUNK_SIZE (256 * 1024)
+#endif
+
+/* Consecutive YAML documents of modules.yaml */
+typedef struct
+{
+  gchar               *yaml;
+  /* Only the latest version of each stream of the chunk is kept */
+  ModulemdModuleIndex *index;
+  GPtrArray           *failures;
+  GError              *error;
+  gboolean             parsed;
+  gboolean             done;
+} ModulemdChunk;
+
+/* Lets chunks be merged, in order, as soon as they are parsed */
+typedef struct
+{
+  GMutex lock;
+  GCond  cond;
+} ModulemdParsing;
+
 static void
-_repo_add_modulemd_defaults (Repo             *repo,
-                             ModulemdDefaults *defaults)
+modulemd_chunk_free (ModulemdChunk *chunk)
 {
-  Pool *pool = repo->pool;
-  const char *n = modulemd_defaults_get_module_name (defaults);
-  const char *s = modulemd_defaults_v1_get_default_stream ((ModulemdDefaultsV1 *)defaults, NULL);
-  g_autofree char *mprov = g_strdup_printf ("module(%s:%s)", n, s);
+  g_free (chunk->yaml);
+  g_clear_object (&chunk->index);
+  g_clear_pointer (&chunk->failures, g_ptr_array_unref);
+  g_clear_error (&chunk->error);
+  g_free (chunk);
+}
 
-  Id dep = pool_str2id (pool, mprov, 0);
-  if (!dep)
-    return;
+/* Copy the latest version of each stream of @index, and the defaults */
+static ModulemdModuleIndex *
+modulemd_index_latest (ModulemdModuleIndex  *index,
+                       GError              **error)
+{
+  g_autoptr(ModulemdModuleIndex) latest = modulemd_module_index_new ();
+  g_auto(GStrv) modnames = modulemd_module_index_get_module_names_as_strv (index);
+  for (GStrv names = modnames; names && *names; names++)
+    {
+      ModulemdModule *mod = modulemd_module_index_get_module (index, *names);
+      g_auto(GStrv) stream_names = modulemd_module_get_stream_names_as_strv (mod);
+      for (GStrv stream_name = stream_names; stream_name && *stream_name; stream_name++)
+        {
+          /* Sorted by version from highest to lowest */
+          g_autoptr(GPtrArray) streams = modulemd_module_get_streams_by_stream_name_as_list (mod, *stream_name);
+          guint64 version = modulemd_module_stream_get_version (g_ptr_array_index (streams, 0));
+          for (unsigned int i = 0; i < streams->len; i++)
+            {
+              ModulemdModuleStream *stream = g_ptr_array_index (streams, i);
+              if (modulemd_module_stream_get_version (stream) != version)
+                break;
+              if (!modulemd_module_index_add_module_stream (latest, stream, error))
+                return NULL;
+            }
+        }
+
+      ModulemdDefaults *defaults = modulemd_module_get_defaults (mod);
+      if (defaults && !modulemd_module_index_add_defaults (latest, defaults, error))
+        return NULL;
+    }
 
-  Id *pp = pool_whatprovides_ptr (pool, dep);
-  for (; *pp; pp++)
-  {
-    Solvable *s = pool_id2solvable (pool, *pp);
-    solvable_add_deparray (s, SOLVABLE_PROVIDES,
-                           pool_str2id (pool, "module-default()", 1),
-                           0);
-  }
+  return g_steal_pointer (&latest);
 }
 
-static gboolean
-repo_add_modulemd (Repo        *repo,
-                   FILE        *fp,
-                   const char  *language,
-                   int          flags,
-                   GError     **error)
+static void
+modulemd_chunk_parse (gpointer data,
+                      gpointer user_data)
 {
-  g_autoptr(GPtrArray) failures = NULL;
+  ModulemdChunk *chunk = data;
+  ModulemdParsing *parsing = user_data;
+
   g_autoptr(ModulemdModuleIndex) index = modulemd_module_index_new ();
-  if (!modulemd_module_index_update_from_stream (index, fp, TRUE, &failures, error))
+  chunk->parsed = modulemd_module_index_update_from_string (index, chunk->yaml, TRUE,
+                                                            &chunk->failures, &chunk->error);
+  g_clear_pointer (&chunk->yaml, g_free);
+
+  /* Older versions are dropped right away, and as upgrading is about as
+   * expensive as parsing, they aren't upgraded either */
+  if (chunk->parsed)
     {
-      if (*error)
-        return FALSE;
+      chunk->index = modulemd_index_latest (index, &chunk->error);
+      g_clear_object (&index);
+      chunk->parsed = chunk->index &&
+        modulemd_module_index_upgrade_streams (chunk->index, MD_MODULESTREAM_VERSION_TWO,
+                                               &chunk->error) &&
+        modulemd_module_index_upgrade_defaults (chunk->index, MD_DEFAULTS_VERSION_ONE,
+                                                &chunk->error);
+    }
+
+  g_mutex_lock (&parsing->lock);
+  chunk->done = TRUE;
+  g_cond_broadcast (&parsing->cond);
+  g_mutex_unlock (&parsing->lock);
+}
+
+/*
+ * Add the streams of @chunk to @index, replacing older versions of them.
+ * @versions maps each "$n:$s" in @index to its version.
+ */
+static gboolean
+modulemd_chunk_merge (ModulemdModuleIndex  *index,
+                      GHashTable           *versions,
+                      ModulemdChunk        *chunk,
+                      GError              **error)
+{
+  if (!chunk->parsed)
+    {
+      if (chunk->error)
+        {
+          g_propagate_error (error, g_steal_pointer (&chunk->error));
+          return FALSE;
+        }
 
-      for (unsigned int i = 0; i < failures->len; i++)
+      for (unsigned int i = 0; chunk->failures && i < chunk->failures->len; i++)
         {
-          ModulemdSubdocumentInfo *info = g_ptr_array_index (failures, i);
+          ModulemdSubdocumentInfo *info = g_ptr_array_index (chunk->failures, i);
           const GError *e = modulemd_subdocument_info_get_gerror (info);
           g_warning ("Failed reading from stream: %s", e->message);
         }
 
+      g_set_error (error,
+                   G_OPTION_ERROR, G_OPTION_ERROR_FAILED,
+                   "Invalid modules metadata");
       return FALSE;
     }
 
-  /* Make sure we are working with the expected version of modulemd documents */
-  if (!modulemd_module_index_upgrade_streams (index, MD_MODULESTREAM_VERSION_TWO, error) ||
-      !modulemd_module_index_upgrade_defaults (index, MD_DEFAULTS_VERSION_ONE, error))
-    return FALSE;
-
-  /* Iterate over modules in the metadata. */
-  g_auto(GStrv) modnames = modulemd_module_index_get_module_names_as_strv (index);
-  /* For each module name ... */
+  g_auto(GStrv) modnames = modulemd_module_index_get_module_names_as_strv (chunk->index);
   for (GStrv names = modnames; names && *names; names++)
     {
-      ModulemdModule *mod = modulemd_module_index_get_module (index, *names);
-      /* ... find all stream names. */
-      g_auto(GStrv) stream_names = modulemd_module_get_stream_names_as_strv (mod);
-
-      /* For each stream name separately ... */
-      for (GStrv stream_name = stream_names; stream_name && *stream_name; stream_name++)
+      ModulemdModule *mod = modulemd_module_index_get_module (chunk->index, *names);
+      GPtrArray *streams = modulemd_module_get_all_streams (mod);
+      for (unsigned int i = 0; i < streams->len; i++)
         {
-          /* ... find all module stream objects. This function conveniently
-           * sorts the result by version from highest to lowest. */
-          g_autoptr(GPtrArray) streams = modulemd_module_get_streams_by_stream_name_as_list(
-                  mod, *stream_name);
-          _repo_add_modulemd_streams (repo, streams);
+          ModulemdModuleStream *stream = g_ptr_array_index (streams, i);
+          const char *stream_name = modulemd_module_stream_get_stream_name (stream);
+          guint64 version = modulemd_module_stream_get_version (stream);
+          g_autofree gchar *key = g_strdup_printf ("%s:%s", *names, stream_name);
+
+          guint64 *latest = g_hash_table_lookup (versions, key);
+          if (latest && *latest > version)
+            continue;
+          if (latest && *latest < version)
+            modulemd_module_remove_streams_by_NSVCA (modulemd_module_index_get_module (index, *names),
+                                                     stream_name, *latest, NULL, NULL);
+          if (!latest || *latest < version)
+            {
+              latest = g_new (guint64, 1);
+              *latest = version;
+              g_hash_table_replace (versions, g_steal_pointer (&key), latest);
+            }
+
+          if (!modulemd_module_index_add_module_stream (index, stream, error))
+            return FALSE;
         }
 
       ModulemdDefaults *defaults = modulemd_module_get_defaults (mod);
-      if (defaults)
-        _repo_add_modulemd_defaults (repo, defaults);
+      if (defaults && !modulemd_module_index_add_defaults (index, defaults, error))
+        return FALSE;
     }
 
   return TRUE;
 }
 
-#ifdef FUS_TESTING
-Repo *
-create_test_repo (Pool        *pool,
-                  const char  *name,
-                  const char  *type,
-                  const char  *path,
-                  GError     **error)
+/*
+ * Find where the last document of @yaml starts, other than at its very
+ * beginning. The marker has to be followed by something for it to be sure
+ * that it's on a line of its own.
+ */
+static gsize
+modulemd_last_document (const char *yaml,
+                        gsize       len)
 {
-  FILE *fp = fopen (path, "r");
-  if (!fp)
-    {
-      g_set_error (error,
-                   G_OPTION_ERROR, G_OPTION_ERROR_FAILED,
-                   "Could not open %s: %s",
-                   path, g_strerror (errno));
-      return NULL;
-    }
+  for (gsize i = len; i-- > 1; )
+    if (yaml[i] == '\n' && i + 4 < len &&
+        strncmp (yaml + i + 1, "---", 3) == 0 && g_ascii_isspace (yaml[i + 4]))
+      return i + 1;
 
-  Repo *repo = repo_create (pool, name);
+  return 0;
+}
 
-  /* Open a file with module metadata and load the content to the repo */
-  if (g_strcmp0 (type, "modular") == 0)
+/*
+ * Read the next chunk of @fp, of about MODULEMD_CHUNK_SIZE bytes and ending
+ * where a document starts. What follows that is kept in @rest, and becomes
+ * the start of the next chunk. @chunk is set to %NULL at the end of @fp.
+ */
+static gboolean
+modulemd_read_chunk (FILE           *fp,
+                     GString        *rest,
+                     ModulemdChunk **chunk,
+                     GError        **error)
+{
+  gsize cut = 0;
+  while (!cut)
     {
-      if (!repo_add_modulemd (repo, fp, NULL, 0, error))
+      gsize len = rest->len;
+      g_string_set_size (rest, len + MODULEMD_CHUNK_SIZE);
+      gsize n = fread (rest->str + len, 1, MODULEMD_CHUNK_SIZE, fp);
+      g_string_set_size (rest, len + n);
+      if (ferror (fp))
         {
-          fclose (fp);
-          return NULL;
+          g_set_error (error,
+                       G_OPTION_ERROR, G_OPTION_ERROR_FAILED,
+                       "Could not read modules metadata: %s", g_strerror (errno));
+          return FALSE;
         }
+
+      /* Documents bigger than a chunk are read on until they end */
+      if (n < MODULEMD_CHUNK_SIZE)
+        cut = rest->len;
+      else
+        cut = modulemd_last_document (rest->str, rest->len);
+      if (!rest->len)
+        break;
     }
-  else
-    testcase_add_testtags (repo, fp, REPO_LOCALPOOL | REPO_EXTEND_SOLVABLES);
 
-  fclose (fp);
+  *chunk = NULL;
+  if (cut)
+    {
+      *chunk = g_new0 (ModulemdChunk, 1);
+      (*chunk)->yaml = g_strndup (rest->str, cut);
+      g_string_erase (rest, 0, cut);
+    }
 
-  return repo;
+  return TRUE;
 }
 
-#else
-
-static const char *
-repomd_find (Repo                 *repo,
-             const char           *what,
-             const unsigned char **chksump,
-             Id                   *chksumtypep)
+/*
+ * Merge the chunks which are parsed, in order, starting at *@merged. Those
+ * before @wait_until are waited for, the rest only merged if they are done.
+ */
+static gboolean
+modulemd_merge_parsed (ModulemdModuleIndex  *index,
+                       GHashTable           *versions,
+                       GPtrArray            *chunks,
+                       guint                *merged,
+                       ModulemdParsing      *parsing,
+                       guint                 wait_until,
+                       GError              **error)
 {
-  Pool *pool = repo->pool;
-  Dataiterator di;
+  while (*merged < chunks->len)
+    {
+      ModulemdChunk *chunk = g_ptr_array_index (chunks, *merged);
+
+      g_mutex_lock (&parsing->lock);
+      while (*merged < wait_until && !chunk->done)
+        g_cond_wait (&parsing->cond, &parsing->lock);
+      gboolean done = chunk->done;
+      g_mutex_unlock (&parsing->lock);
+      if (!done)
+        break;
 
-  dataiterator_init (&di, pool, repo, SOLVID_META, REPOSITORY_REPOMD_TYPE, what, SEARCH_STRING);
-  dataiterator_prepend_keyname (&di, REPOSITORY_REPOMD);
+      gboolean ret = modulemd_chunk_merge (index, versions, chunk, error);
+      g_clear_object (&chunk->index);
+      (*merged)++;
+      if (!ret)
+        return FALSE;
+    }
 
-  const char *filename = NULL;
-  *chksump = NULL;
-  *chksumtypep = 0;
+  return TRUE;
+}
 
-  if (dataiterator_step (&di))
+/*
+ * Parse the modulemd documents of @fp, keeping only the latest version of
+ * each stream. The file is read in chunks, which are parsed on all cores and
+ * merged in the order they were in the file as they are done, so that older
+ * versions never pile up. Only a few chunks per core are read ahead of the
+ * merging, so memory use doesn't grow with the size of the file.
+ */
+static ModulemdModuleIndex *
+modulemd_index_from_stream (FILE    *fp,
+                            GError **error)
+{
+  ModulemdParsing parsing;
+  g_mutex_init (&parsing.lock);
+  g_cond_init (&parsing.cond);
+
+  g_autoptr(ModulemdModuleIndex) index = modulemd_module_index_new ();
+  g_autoptr(GHashTable) versions = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+  g_autoptr(GPtrArray) chunks = g_ptr_array_new_with_free_func ((GDestroyNotify) modulemd_chunk_free);
+  g_autoptr(GString) rest = g_string_new (NULL);
+  GThreadPool *threads = NULL;
+  guint merged = 0;
+
+  ModulemdChunk *chunk = NULL;
+  gboolean ret = modulemd_read_chunk (fp, rest, &chunk, error);
+  while (ret && chunk)
     {
-      dataiterator_setpos_parent (&di);
-      filename = pool_lookup_str (pool, SOLVID_POS, REPOSITORY_REPOMD_LOCATION);
-      *chksump = pool_lookup_bin_checksum (pool, SOLVID_POS, REPOSITORY_REPOMD_CHECKSUM, chksumtypep);
+      g_ptr_array_add (chunks, chunk);
+      ModulemdChunk *next = NULL;
+      ret = modulemd_read_chunk (fp, rest, &next, error);
+      if (!ret)
+        break;
+
+      /* Files of a single chunk are parsed right here */
+      if (!next && !threads)
+        {
+          modulemd_chunk_parse (chunk, &parsing);
+          break;
+        }
+
+      if (!threads)
+        threads = g_thread_pool_new (modulemd_chunk_parse, &parsing,
+                                     g_get_num_processors (), TRUE, NULL);
+      g_thread_pool_push (threads, chunk, NULL);
+
+      /* Merging what is parsed already keeps older versions from piling up,
+       * and reading only goes on while few chunks are queued, as it's much
+       * faster than parsing and would otherwise queue the whole file */
+      guint max_pending = 2 * g_get_num_processors ();
+      ret = modulemd_merge_parsed (index, versions, chunks, &merged, &parsing,
+                                   chunks->len > max_pending ? chunks->len - max_pending : 0,
+                                   error);
+      if (!ret)
+        g_clear_pointer (&next, modulemd_chunk_free);
+      chunk = next;
     }
 
-  dataiterator_free (&di);
+  if (ret)
+    ret = modulemd_merge_parsed (index, versions, chunks, &merged, &parsing, chunks->len, error);
 
-  if (filename && !*chksumtypep)
+  /* Chunks not started yet are dropped after a failure */
+  if (threads)
+    g_thread_pool_free (threads, !ret, TRUE);
+  g_mutex_clear (&parsing.lock);
+  g_cond_clear (&parsing.cond);
+
+  return ret ? g_steal_pointer (&index) : NULL;
+}
+
+static gboolean
+repo_add_modulemd (Repo        *repo,
+                   FILE        *fp,
+                   const char  *language,
+                   int          flags,
+                   GError     **error)
+{
+  g_autoptr(ModulemdModuleIndex) index = modulemd_index_from_stream (fp, error);
+  if (!index)
+    return FALSE;
+
+  /* The artifacts are kept apart from the solvables the modules are made of */
+  Repodata *data = repo_add_repodata (repo, 0);
+
+  /* Iterate over modules in the metadata. */
+  g_auto(GStrv) modnames = modulemd_module_index_get_module_names_as_strv (index);
+  /* For each module name ... */
+  for (GStrv names = modnames; names && *names; names++)
     {
-      g_warning ("No %s file checksum", what);
-      filename = NULL;
+      ModulemdModule *mod = modulemd_module_index_get_module (index, *names);
+      /* ... find all stream names. */
+      g_auto(GStrv) stream_names = modulemd_module_get_stream_names_as_strv (mod);
+      ModulemdDefaults *defaults = modulemd_module_get_defaults (mod);
+      const char *default_stream = defaults ?
+        modulemd_defaults_v1_get_default_stream ((ModulemdDefaultsV1 *) defaults, NULL) : NULL;
+
+      /* The default stream may well come from other repos, so the module
+       * solvables are only marked once all of them are loaded */
+      if (default_stream)
+        {
+          g_autofree char *nsprov = g_strdup_printf (TMPL_NSPROV, *names, default_stream);
+          repodata_add_idarray (data, SOLVID_META,
+                                pool_str2id (repo->pool, DEFAULTS_KEY, 1),
+                                pool_str2id (repo->pool, nsprov, 1));
+        }
+
+      /* For each stream name separately ... */
+      for (GStrv stream_name = stream_names; stream_name && *stream_name; stream_name++)
+        {
+          /* ... find all module stream objects. This function conveniently
+           * sorts the result by version from highest to lowest. */
+          g_autoptr(GPtrArray) streams = modulemd_module_get_streams_by_stream_name_as_list(
+                  mod, *stream_name);
+          _repo_add_modulemd_streams (repo, data, streams);
+        }
     }
 
-  return filename;
+  repodata_internalize (data);
+
+  return TRUE;
 }
 
-/* Returns checksum as a hexadecimal string which we can use as filename */
+static inline gchar *
+get_repo_cachedir (const char *name)
+{
+  return g_build_filename (g_get_user_cache_dir (), "fus", name, NULL);
+}
+
+/*
+ * Cache of the packages of @repo which are artifacts of the modules of
+ * @modules, named after the repomd.xml checksums of both and the name of
+ * @repo. It's stored with the caches of @modules, so it goes away with them.
+ */
 static gchar *
-chksum_string_for_filepath (GChecksumType type, const char *filepath)
+artifacts_overlay_path (Repo *modules,
+                        Repo *repo)
 {
-  gsize len = 0;
-  g_autofree gchar *data = NULL;
-  if (!g_file_get_contents (filepath, &data, &len, NULL))
+  if (!modules->appdata || !repo->appdata)
     return NULL;
 
-  return g_compute_checksum_for_string (type, data, len);
+  g_autofree gchar *cachedir = get_repo_cachedir (modules->name);
+  g_autofree gchar *name = g_strdup_printf ("%s-overlay-%s-%s",
+                                            (const char *) modules->appdata,
+                                            repo->name,
+                                            (const char *) repo->appdata);
+  return g_build_filename (cachedir, name, NULL);
 }
 
-static gboolean
-checksum_matches (const char          *filepath,
-                  const unsigned char *chksum,
-                  Id                   chksumtype)
+/*
+ * Remove the overlays of @modules for older metadata of @repo, which are
+ * never used again once @repo changed, but would be kept with the caches of
+ * @modules for as long as those are current.
+ */
+static void
+artifacts_overlay_gc (Repo *modules,
+                      Repo *repo)
 {
-  gsize len = 0;
-  g_autofree gchar *contents = NULL;
-  if (!g_file_get_contents (filepath, &contents, &len, NULL))
-    return FALSE;
-
-  Chksum *filechksum = solv_chksum_create (chksumtype);
-  if (!filechksum)
-    return FALSE;
-  solv_chksum_add (filechksum, contents, len);
-
-  int clen;
-  const unsigned char *binsum = solv_chksum_get (filechksum, &clen);
-  int ret = memcmp (chksum, binsum, clen);
-  solv_chksum_free (filechksum, NULL);
+  g_autofree gchar *cachedir = get_repo_cachedir (modules->name);
+  g_autofree gchar *prefix = g_strdup_printf ("%s-overlay-%s-",
+                                              (const char *) modules->appdata,
+                                              repo->name);
+  const char *current = repo->appdata;
+
+  g_autoptr(GDir) dir = g_dir_open (cachedir, 0, NULL);
+  const char *name;
+  while (dir && (name = g_dir_read_name (dir)))
+    {
+      if (!g_str_has_prefix (name, prefix))
+        continue;
+      /* Only the checksum may follow, not the rest of a longer repo name */
+      const char *chksum = name + strlen (prefix);
+      if (strlen (chksum) != strlen (current) || strchr (chksum, '-') ||
+          strcmp (chksum, current) == 0)
+        continue;
 
-  return ret == 0;
+      g_autofree gchar *path = g_build_filename (cachedir, name, NULL);
+      if (g_unlink (path) == 0)
+        g_debug ("Removed stale overlay %s", path);
+    }
 }
 
+/*
+ * Annotate the packages of @repo listed in @pairs, as offsets of the package
+ * in @repo and of its module in @modules. Nothing is changed unless all of
+ * them are valid.
+ */
 static gboolean
-download_to_path (SoupSession  *session,
-                  const char   *url,
-                  const char   *path,
-                  GError      **error)
+artifacts_overlay_apply (Repo  *modules,
+                         Repo  *repo,
+                         Queue *pairs)
 {
-  g_autoptr(SoupURI) parsed = soup_uri_new (url);
-  g_autoptr(GFile) file = g_file_new_for_path (path);
+  Pool *pool = repo->pool;
 
-  if (!SOUP_URI_VALID_FOR_HTTP (parsed))
+  for (int i = 0; i < pairs->count; i += 2)
     {
-      g_autoptr(GFile) local = g_file_new_for_path (url);
-      return g_file_copy (local, file, G_FILE_COPY_OVERWRITE, NULL, NULL, NULL, error);
+      Id p = repo->start + pairs->elements[i];
+      Id m = modules->start + pairs->elements[i + 1];
+      if (pairs->elements[i] < 0 || p >= repo->end ||
+          pairs->elements[i + 1] < 0 || m >= modules->end ||
+          pool->solvables[p].repo != repo || pool->solvables[m].repo != modules)
+        return FALSE;
     }
 
-  g_debug ("Downloading %s to %s", url, path);
-
-  g_autoptr(SoupMessage) msg = soup_message_new_from_uri ("GET", parsed);
-  g_autoptr(GInputStream) istream = soup_session_send (session, msg, NULL, error);
-  if (!SOUP_STATUS_IS_SUCCESSFUL (msg->status_code))
-    return FALSE;
-
-  g_autoptr(GFileOutputStream) ostream = g_file_replace (file,
-                                                         NULL,
-                                                         FALSE,
-                                                         G_FILE_CREATE_REPLACE_DESTINATION,
-                                                         NULL,
-                                                         error);
-  if (!ostream)
-    return FALSE;
-
-  if (g_output_stream_splice (G_OUTPUT_STREAM (ostream), istream, 0, NULL, error) == -1)
-    return FALSE;
+  for (int i = 0; i < pairs->count; i += 2)
+    add_artifacts_dependencies (pool,
+                                pool->solvables + repo->start + pairs->elements[i],
+                                pool->solvables + modules->start + pairs->elements[i + 1]);
 
   return TRUE;
 }
 
-static const char *
-download_repo_metadata (SoupSession *session,
-                        Repo        *repo,
-                        const char  *type,
-                        const char  *repo_url,
-                        const char  *cachedir)
+static gboolean
+artifacts_overlay_load (Repo       *modules,
+                        Repo       *repo,
+                        const char *path)
 {
-  Id chksumtype;
-  const char *fpath, *fname;
-  const unsigned char *chksum;
-
-  fname = repomd_find (repo, type, &chksum, &chksumtype);
-  if (!fname)
-    return NULL;
+  g_autofree gchar *contents = NULL;
+  if (!g_file_get_contents (path, &contents, NULL, NULL))
+    return FALSE;
 
-  fpath = pool_tmpjoin (repo->pool, cachedir, "/", fname);
-  if (!g_file_test (fpath, G_FILE_TEST_IS_REGULAR) ||
-      !checksum_matches (fpath, chksum, chksumtype))
+  g_auto(Queue) pairs;
+  queue_init (&pairs);
+  g_auto(GStrv) lines = g_strsplit (contents, "\n", -1);
+  for (GStrv line = lines; *line; line++)
     {
-      g_autoptr(GError) error = NULL;
-      const char *furl = pool_tmpjoin (repo->pool, repo_url, "/", fname);
-      if (!download_to_path (session, furl, fpath, &error))
-        {
-          g_warning ("Could not download %s: %s", furl, error->message);
-          return NULL;
-        }
+      if (!**line)
+        continue;
+      unsigned int p, m;
+      if (sscanf (*line, "%u %u", &p, &m) != 2)
+        return FALSE;
+      queue_push2 (&pairs, p, m);
     }
 
-  return fpath;
+  return artifacts_overlay_apply (modules, repo, &pairs);
+}
+
+static void
+artifacts_overlay_write (Queue      *pairs,
+                         const char *path)
+{
+  g_autofree gchar *tmppath = NULL;
+  FILE *fp = cache_file_create (path, &tmppath);
+  if (!fp)
+    {
+      g_warning ("Could not open cache file %s: %s", path, g_strerror (errno));
+      return;
+    }
+
+  for (int i = 0; i < pairs->count; i += 2)
+    fprintf (fp, "%d %d\n", pairs->elements[i], pairs->elements[i + 1]);
+
+  g_autoptr(GError) error = NULL;
+  if (!cache_file_commit (fp, tmppath, path, &error))
+    g_warning ("%s", error->message);
+}
+
+/* Packages by name, evr and arch, which is what artifacts are matched on */
+typedef struct
+{
+  Pool    *pool;
+  Id      *table;
+  Hashval  mask;
+  /* Next package with the same name, evr and arch, by solvable id */
+  Id      *next;
+} NevraIndex;
+
+static inline Hashval
+nevra_hash (Id name, Id evr, Id arch)
+{
+  return name * 7 + evr * 13 + arch * 29;
+}
+
+static inline gboolean
+nevra_equals (Solvable *s, Id name, Id evr, Id arch)
+{
+  return s->name == name && s->evr == evr && s->arch == arch;
+}
+
+/*
+ * Index all packages except those of the system repo. Source packages can't
+ * be artifacts, like they never were when matching by name through
+ * whatprovides.
+ */
+static void
+nevra_index_init (NevraIndex *index,
+                  Pool       *pool)
+{
+  index->pool = pool;
+  index->mask = mkmask (pool->nsolvables);
+  index->table = solv_calloc (index->mask + 1, sizeof (Id));
+  index->next = solv_calloc (pool->nsolvables, sizeof (Id));
+
+  /* Going backwards so that the chains end up sorted */
+  for (Id p = pool->nsolvables - 1; p >= 2; p--)
+    {
+      Solvable *s = pool->solvables + p;
+      if (!s->repo || s->repo == pool->installed ||
+          s->arch == ARCH_SRC || s->arch == ARCH_NOSRC)
+        continue;
+
+      Hashval h = nevra_hash (s->name, s->evr, s->arch) & index->mask;
+      Hashval hh = HASHCHAIN_START;
+      Id q;
+      while ((q = index->table[h]) && !nevra_equals (pool->solvables + q, s->name, s->evr, s->arch))
+        h = HASHCHAIN_NEXT (h, hh, index->mask);
+
+      index->next[p] = q;
+      index->table[h] = p;
+    }
+}
+
+static void
+nevra_index_free (NevraIndex *index)
+{
+  index->table = solv_free (index->table);
+  index->next = solv_free (index->next);
+}
+
+/* Returns the first package matching the "$n.$a = $evr" @dep, the others
+ * follow through index->next */
+static Id
+nevra_index_lookup (NevraIndex *index,
+                    Id          dep)
+{
+  Pool *pool = index->pool;
+  if (!ISRELDEP (dep))
+    return 0;
+  Reldep *rd = GETRELDEP (pool, dep);
+  if (rd->flags != REL_EQ || !ISRELDEP (rd->name))
+    return 0;
+  Reldep *na = GETRELDEP (pool, rd->name);
+  if (na->flags != REL_ARCH)
+    return 0;
+
+  Hashval h = nevra_hash (na->name, rd->evr, na->evr) & index->mask;
+  Hashval hh = HASHCHAIN_START;
+  Id q;
+  while ((q = index->table[h]) && !nevra_equals (pool->solvables + q, na->name, rd->evr, na->evr))
+    h = HASHCHAIN_NEXT (h, hh, index->mask);
+
+  return q;
+}
+
+/**
+ * pool_add_module_artifacts:
+ * @pool: pool with all repos loaded
+ * @repos: the loaded repos, in order
+ *
+ * Make the packages listed as rpm artifacts of a module require it and
+ * provide modular-package(). The packages can be in any repo, so this can
+ * only be done once all of them are loaded. What matched between the modules
+ * of a repo and the packages of another one is cached, and only repos for
+ * which that isn't cached yet are matched again, through an index of the
+ * packages built the first time it's needed.
+ */
+void
+pool_add_module_artifacts (Pool      *pool,
+                           GPtrArray *repos)
+{
+  Id key = pool_str2id (pool, ARTIFACTS_KEY, 0);
+  if (!key)
+    return;
+
+  NevraIndex index = { NULL, };
+  for (unsigned int i = 0; i < repos->len; i++)
+    {
+      Repo *modules = g_ptr_array_index (repos, i);
+
+      /* Module solvable followed by one of its artifacts */
+      g_auto(Queue) artifacts;
+      queue_init (&artifacts);
+      Dataiterator di;
+      dataiterator_init (&di, pool, modules, 0, key, 0, 0);
+      while (dataiterator_step (&di))
+        queue_push2 (&artifacts, di.solvid, di.kv.id);
+      dataiterator_free (&di);
+      if (!artifacts.count)
+        continue;
+
+      /* Repos the cached overlay of which can't be used */
+      g_autoptr(GPtrArray) pending = g_ptr_array_new ();
+      for (unsigned int j = 0; j < repos->len; j++)
+        {
+          Repo *repo = g_ptr_array_index (repos, j);
+          /* Only has the platform module */
+          if (repo == pool->installed)
+            continue;
+
+          g_autofree gchar *path = artifacts_overlay_path (modules, repo);
+          if (path && artifacts_overlay_load (modules, repo, path))
+            continue;
+          g_ptr_array_add (pending, repo);
+        }
+      if (!pending->len)
+        continue;
+
+      if (!index.table)
+        nevra_index_init (&index, pool);
+
+      Queue *pairs = g_new (Queue, pending->len);
+      for (unsigned int j = 0; j < pending->len; j++)
+        queue_init (&pairs[j]);
+
+      for (int a = 0; a < artifacts.count; a += 2)
+        {
+          Id m = artifacts.elements[a];
+          for (Id p = nevra_index_lookup (&index, artifacts.elements[a + 1]); p; p = index.next[p])
+            {
+              Repo *repo = pool_id2solvable (pool, p)->repo;
+              for (unsigned int j = 0; j < pending->len; j++)
+                if (g_ptr_array_index (pending, j) == repo)
+                  queue_push2 (&pairs[j], p - repo->start, m - modules->start);
+            }
+        }
+
+      for (unsigned int j = 0; j < pending->len; j++)
+        {
+          Repo *repo = g_ptr_array_index (pending, j);
+          artifacts_overlay_apply (modules, repo, &pairs[j]);
+
+          g_autofree gchar *path = artifacts_overlay_path (modules, repo);
+          if (path)
+            {
+              artifacts_overlay_write (&pairs[j], path);
+              artifacts_overlay_gc (modules, repo);
+            }
+          queue_free (&pairs[j]);
+        }
+      g_free (pairs);
+    }
+
+  nevra_index_free (&index);
+}
+
+/**
+ * pool_add_module_defaults:
+ * @pool: pool with all repos loaded
+ * @repos: the loaded repos
+ *
+ * Make the module solvables of default streams provide module-default().
+ * Defaults can come with the metadata of any repo, not only with the
+ * modules they apply to, so this can only be done once all of them are
+ * loaded. The module solvables are matched on their module($n:$s) provide.
+ */
+void
+pool_add_module_defaults (Pool      *pool,
+                          GPtrArray *repos)
+{
+  Id key = pool_str2id (pool, DEFAULTS_KEY, 0);
+  if (!key)
+    return;
+
+  g_auto(Map) defaults;
+  map_init (&defaults, pool->ss.nstrings);
+  gboolean any = FALSE;
+  for (unsigned int i = 0; i < repos->len; i++)
+    {
+      Dataiterator di;
+      dataiterator_init (&di, pool, g_ptr_array_index (repos, i), SOLVID_META, key, 0, 0);
+      while (dataiterator_step (&di))
+        {
+          MAPSET (&defaults, di.kv.id);
+          any = TRUE;
+        }
+      dataiterator_free (&di);
+    }
+  if (!any)
+    return;
+
+  g_auto(Queue) solvables;
+  queue_init (&solvables);
+  for (unsigned int i = 0; i < repos->len; i++)
+    {
+      Repo *repo = g_ptr_array_index (repos, i);
+      Solvable *s;
+      Id p;
+      FOR_REPO_SOLVABLES (repo, p, s)
+        {
+          if (!s->provides)
+            continue;
+          /* Prv: module($n:$s) = $v */
+          for (Id *prv = repo->idarraydata + s->provides; *prv; prv++)
+            {
+              if (!ISRELDEP (*prv))
+                continue;
+              Reldep *rd = GETRELDEP (pool, *prv);
+              if (rd->flags == REL_EQ && !ISRELDEP (rd->name) &&
+                  MAPTST (&defaults, rd->name))
+                {
+                  queue_push (&solvables, p);
+                  break;
+                }
+            }
+        }
+    }
+
+  _repo_add_modulemd_defaults (pool, &solvables);
+}
+
+#ifdef FUS_TESTING
+Repo *
+create_test_repo (Pool        *pool,
+                  const char  *name,
+                  const char  *type,
+                  const char  *path,
+                  GError     **error)
+{
+  FILE *fp = fopen (path, "r");
+  if (!fp)
+    {
+      g_set_error (error,
+                   G_OPTION_ERROR, G_OPTION_ERROR_FAILED,
+                   "Could not open %s: %s",
+                   path, g_strerror (errno));
+      return NULL;
+    }
+
+  Repo *repo = repo_create (pool, name);
+
+  /* Open a file with module metadata and load the content to the repo */
+  if (g_strcmp0 (type, MODULAR_TYPE) == 0)
+    {
+      if (!repo_add_modulemd (repo, fp, NULL, 0, error))
+        {
+          fclose (fp);
+          return NULL;
+        }
+    }
+  else
+    testcase_add_testtags (repo, fp, REPO_LOCALPOOL | REPO_EXTEND_SOLVABLES);
+
+  fclose (fp);
+
+  return repo;
+}
+#endif
+
+static const char *
+repomd_find (Repo                 *repo,
+             const char           *what,
+             const unsigned char **chksump,
+             Id                   *chksumtypep)
+{
+  Pool *pool = repo->pool;
+  Dataiterator di;
+
+  dataiterator_init (&di, pool, repo, SOLVID_META, REPOSITORY_REPOMD_TYPE, what, SEARCH_STRING);
+  dataiterator_prepend_keyname (&di, REPOSITORY_REPOMD);
+
+  const char *filename = NULL;
+  *chksump = NULL;
+  *chksumtypep = 0;
+
+  if (dataiterator_step (&di))
+    {
+      dataiterator_setpos_parent (&di);
+      filename = pool_lookup_str (pool, SOLVID_POS, REPOSITORY_REPOMD_LOCATION);
+      *chksump = pool_lookup_bin_checksum (pool, SOLVID_POS, REPOSITORY_REPOMD_CHECKSUM, chksumtypep);
+    }
+
+  dataiterator_free (&di);
+
+  if (filename && !*chksumtypep)
+    {
+      g_warning ("No %s file checksum", what);
+      filename = NULL;
+    }
+
+  return filename;
+}
+
+#define CHKSUM_BUFSIZE (64 * 1024)
+
+/* Hash the file in fixed-size chunks, so memory use doesn't depend on its size */
+static Chksum *
+chksum_for_filepath (Id type, const char *filepath)
+{
+  FILE *fp = g_fopen (filepath, "rb");
+  if (!fp)
+    return NULL;
+
+  Chksum *chk = solv_chksum_create (type);
+  if (chk)
+    {
+      unsigned char buf[CHKSUM_BUFSIZE];
+      size_t len;
+      while ((len = fread (buf, 1, sizeof (buf), fp)) > 0)
+        solv_chksum_add (chk, buf, len);
+      if (ferror (fp))
+        chk = solv_chksum_free (chk, NULL);
+    }
+
+  fclose (fp);
+  return chk;
+}
+
+/* Returns checksum as a hexadecimal string which we can use as filename */
+static gchar *
+chksum_string_for_filepath (Id type, const char *filepath)
+{
+  Chksum *chk = chksum_for_filepath (type, filepath);
+  if (!chk)
+    return NULL;
+
+  int len;
+  const unsigned char *binsum = solv_chksum_get (chk, &len);
+  gchar *str = g_malloc (2 * len + 1);
+  solv_bin2hex (binsum, len, str);
+  solv_chksum_free (chk, NULL);
+
+  return str;
+}
+
+/*
+ * A stamp is a small file stored in the repo cache dir for each verified
+ * metadata file, next to it unless the file is read in place from a local
+ * repo. It records the size, mtime and inode the file had when its checksum
+ * was verified, so that as long as those don't change the file doesn't need
+ * to be hashed again.
+ */
+static gchar *
+stamp_contents (const char          *filepath,
+                const unsigned char *chksum,
+                Id                   chksumtype)
+{
+  GStatBuf st;
+  if (g_stat (filepath, &st) == -1)
+    return NULL;
+
+  int len = solv_chksum_len (chksumtype);
+  g_autofree gchar *hex = g_malloc (2 * len + 1);
+  solv_bin2hex (chksum, len, hex);
+
+  return g_strdup_printf ("%" G_GUINT64_FORMAT " %" G_GINT64_FORMAT ".%09ld %" G_GUINT64_FORMAT " %s:%s\n",
+                          (guint64) st.st_size,
+                          (gint64) st.st_mtim.tv_sec, (long) st.st_mtim.tv_nsec,
+                          (guint64) st.st_ino,
+                          solv_chksum_type2str (chksumtype), hex);
+}
+
+static gboolean
+stamp_matches (const char          *filepath,
+               const char          *stamppath,
+               const unsigned char *chksum,
+               Id                   chksumtype)
+{
+  g_autofree gchar *expected = stamp_contents (filepath, chksum, chksumtype);
+  if (!expected)
+    return FALSE;
+
+  g_autofree gchar *contents = NULL;
+  if (!g_file_get_contents (stamppath, &contents, NULL, NULL))
+    return FALSE;
+
+  return g_strcmp0 (contents, expected) == 0;
+}
+
+static void
+stamp_write (const char          *filepath,
+             const char          *stamppath,
+             const unsigned char *chksum,
+             Id                   chksumtype)
+{
+  g_autofree gchar *contents = stamp_contents (filepath, chksum, chksumtype);
+  if (!contents)
+    return;
+
+  g_autoptr(GError) error = NULL;
+  if (!g_file_set_contents (stamppath, contents, -1, &error))
+    g_debug ("Could not write stamp %s: %s", stamppath, error->message);
+}
+
+static gboolean
+checksum_matches (const char          *filepath,
+                  const char          *stamppath,
+                  const unsigned char *chksum,
+                  Id                   chksumtype)
+{
+  if (stamp_matches (filepath, stamppath, chksum, chksumtype))
+    return TRUE;
+
+  Chksum *filechksum = chksum_for_filepath (chksumtype, filepath);
+  if (!filechksum)
+    return FALSE;
+
+  Chksum *expected = solv_chksum_create_from_bin (chksumtype, chksum);
+  gboolean ret = solv_chksum_cmp (filechksum, expected);
+  solv_chksum_free (expected, NULL);
+  solv_chksum_free (filechksum, NULL);
+
+  if (ret)
+    stamp_write (filepath, stamppath, chksum, chksumtype);
+
+  return ret;
+}
+
+static gboolean
+repo_is_local (const char *path)
+{
+  g_autoptr(SoupURI) uri = soup_uri_new (path);
+  return !SOUP_URI_VALID_FOR_HTTP (uri);
+}
+
+/* Whether libsolv was built with zchunk support, so it can read those files */
+static gboolean
+zck_supported (void)
+{
+  return solv_xfopen_iscompressed (".zck") == 1;
+}
+
+/*
+ * Like repomd_find, but for remote repos prefer the zchunk variant of the
+ * metadata if there is one, as those can be updated incrementally.
+ */
+static const char *
+repomd_find_file (Repo                 *repo,
+                  const char           *what,
+                  gboolean              remote,
+                  const unsigned char **chksump,
+                  Id                   *chksumtypep)
+{
+  if (remote && zck_supported ())
+    {
+      g_autofree gchar *zckwhat = g_strconcat (what, "_zck", NULL);
+      const char *fname = repomd_find (repo, zckwhat, chksump, chksumtypep);
+      if (fname)
+        return fname;
+    }
+
+  return repomd_find (repo, what, chksump, chksumtypep);
+}
+
+/*
+ * Find an older version of the zchunk file @fpath in the cache, which chunks
+ * can be reused from. Metadata file names are prefixed with their checksum,
+ * so that is the most recent file with the same name apart from that.
+ */
+static gchar *
+find_zck_seed (const char *fpath)
+{
+  if (!g_str_has_suffix (fpath, ".zck"))
+    return NULL;
+
+  g_autofree gchar *dirname = g_path_get_dirname (fpath);
+  g_autofree gchar *basename = g_path_get_basename (fpath);
+  const char *suffix = strchr (basename, '-');
+  if (!suffix)
+    suffix = basename;
+
+  g_autoptr(GDir) dir = g_dir_open (dirname, 0, NULL);
+  if (!dir)
+    return NULL;
+
+  gchar *seed = NULL;
+  gint64 seedmtime = 0;
+  const char *name;
+  while ((name = g_dir_read_name (dir)))
+    {
+      if (!g_str_has_suffix (name, suffix))
+        continue;
+
+      GStatBuf st;
+      g_autofree gchar *path = g_build_filename (dirname, name, NULL);
+      if (g_stat (path, &st) == -1 || !S_ISREG (st.st_mode) || st.st_mtime < seedmtime)
+        continue;
+
+      g_free (seed);
+      seed = g_steal_pointer (&path);
+      seedmtime = st.st_mtime;
+    }
+
+  return seed;
+}
+
+/*
+ * Create a download of @fname, relative to @repo_url, which falls back to the
+ * other mirrors of the repo if it was given as a mirror list.
+ */
+static Download *
+repo_download_new (const char *repo_url,
+                   const char *cachedir,
+                   const char *fname,
+                   const char *fpath)
+{
+  g_autofree gchar *furl = g_strconcat (repo_url, "/", fname, NULL);
+  Download *dl = download_new (furl, fpath);
+
+  /* Only repos given as a mirror list have mirrors saved, see
+   * resolve_repos_mirrors() */
+  g_autofree gchar *mirrorspath = g_build_filename (cachedir, "mirrors", NULL);
+  g_autoptr(GPtrArray) mirrors = mirrors_load (mirrorspath);
+  if (mirrors)
+    download_set_mirrors (dl, mirrors, fname);
+
+  return dl;
+}
+
+/* Download a metadata file, incrementally if an older version is cached */
+static gboolean
+fetch_metadata_file (SoupSession          *session,
+                     const char           *repo_url,
+                     const char           *cachedir,
+                     const char           *fname,
+                     const char           *fpath,
+                     Id                    chksumtype,
+                     const unsigned char  *chksum,
+                     GError              **error)
+{
+  g_autoptr(Download) dl = repo_download_new (repo_url, cachedir, fname, fpath);
+  download_set_checksum (dl, chksumtype, chksum);
+
+  g_autofree gchar *seed = find_zck_seed (fpath);
+  if (seed && session)
+    {
+      g_autoptr(GError) e = NULL;
+      if (download_zck (session, dl, seed, &e))
+        return TRUE;
+      g_debug ("Could not download %s incrementally: %s", dl->url, e->message);
+    }
+
+  return download_run (session, dl, error);
+}
+
+static const char *
+download_repo_metadata (SoupSession *session,
+                        Repo        *repo,
+                        const char  *type,
+                        const char  *repo_url,
+                        const char  *cachedir)
+{
+  Id chksumtype;
+  const char *fpath, *fname;
+  const unsigned char *chksum;
+
+  fname = repomd_find_file (repo, type, !repo_is_local (repo_url), &chksum, &chksumtype);
+  if (!fname)
+    return NULL;
+
+  const char *stamppath = pool_tmpjoin (repo->pool, cachedir, "/", fname);
+  stamppath = pool_tmpappend (repo->pool, stamppath, ".stamp", 0);
+
+  /* Files of local repos are used in place, there is no point in copying them */
+  if (repo_is_local (repo_url))
+    {
+      fpath = pool_tmpjoin (repo->pool, repo_url, "/", fname);
+      if (!checksum_matches (fpath, stamppath, chksum, chksumtype))
+        {
+          g_warning ("Checksum of %s does not match repomd.xml", fpath);
+          return NULL;
+        }
+      return fpath;
+    }
+
+  fpath = pool_tmpjoin (repo->pool, cachedir, "/", fname);
+  if (!g_file_test (fpath, G_FILE_TEST_IS_REGULAR) ||
+      !checksum_matches (fpath, stamppath, chksum, chksumtype))
+    {
+      g_autoptr(GError) error = NULL;
+      if (!fetch_metadata_file (session, repo_url, cachedir, fname, fpath, chksumtype, chksum, &error))
+        {
+          g_warning ("Could not download %s: %s", fname, error->message);
+          return NULL;
+        }
+      /* The checksum was verified while downloading */
+      stamp_write (fpath, stamppath, chksum, chksumtype);
+    }
+
+  return fpath;
+}
+
+/* Whether the given metadata file of a remote repo is already in cache and valid */
+static gboolean
+repo_metadata_cached (Repo       *repo,
+                      const char *type,
+                      const char *cachedir)
+{
+  Id chksumtype;
+  const unsigned char *chksum;
+  const char *fname = repomd_find_file (repo, type, TRUE, &chksum, &chksumtype);
+  if (!fname)
+    return FALSE;
+
+  const char *fpath = pool_tmpjoin (repo->pool, cachedir, "/", fname);
+  g_autofree gchar *stamppath = g_strconcat (fpath, ".stamp", NULL);
+  return g_file_test (fpath, G_FILE_TEST_IS_REGULAR) &&
+         checksum_matches (fpath, stamppath, chksum, chksumtype);
+}
+
+/* Whether the given metadata file of a remote repo can be downloaded
+ * incrementally, which beats streaming the whole file */
+static gboolean
+repo_metadata_has_seed (Repo       *repo,
+                        const char *type,
+                        const char *cachedir)
+{
+  Id chksumtype;
+  const unsigned char *chksum;
+  const char *fname = repomd_find_file (repo, type, TRUE, &chksum, &chksumtype);
+  if (!fname)
+    return FALSE;
+
+  g_autofree gchar *seed = find_zck_seed (pool_tmpjoin (repo->pool, cachedir, "/", fname));
+  return seed != NULL;
+}
+
+/*
+ * Download primary metadata into the cache while decompressing and parsing
+ * them into @repo, instead of parsing them only once they are on the disk.
+ */
+static gboolean
+stream_repo_primary (SoupSession  *session,
+                     Repo         *repo,
+                     const char   *repo_url,
+                     const char   *cachedir,
+                     GError      **error)
+{
+  Id chksumtype;
+  const unsigned char *chksum;
+  const char *fname = repomd_find_file (repo, "primary", TRUE, &chksum, &chksumtype);
+  if (!fname)
+    return TRUE;
+
+  const char *fpath = pool_tmpjoin (repo->pool, cachedir, "/", fname);
+  g_autoptr(Download) dl = repo_download_new (repo_url, cachedir, fname, fpath);
+  download_set_checksum (dl, chksumtype, chksum);
+
+  DownloadStream *stream = download_stream_open (session, dl, error);
+  if (!stream)
+    return FALSE;
+
+  repo_add_rpmmd (repo, download_stream_get_fp (stream), NULL, 0);
+
+  if (!download_stream_close (stream, error))
+    {
+      g_prefix_error (error, "Could not download %s: ", dl->url);
+      return FALSE;
+    }
+
+  g_autofree gchar *stamppath = g_strconcat (dl->path, ".stamp", NULL);
+  stamp_write (dl->path, stamppath, chksum, chksumtype);
+
+  return TRUE;
 }
 
 static void
@@ -563,166 +1541,1049 @@ switch_to_cached_repo (Repo        *repo,
                        const char  *repoext,
                        const char  *cachepath)
 {
-  int i;
+  int i;
+  FILE *fp;
+
+  if (!repoext && repodata)
+    return;
+
+  for (i = repo->start; i < repo->end; i++)
+    if (repo->pool->solvables[i].repo != repo)
+      break;
+
+  if (i < repo->end)
+    return; /* not a simple block */
+
+  fp = cache_file_open (cachepath);
+  if (!fp)
+    return;
+
+  /* main repo */
+  if (!repoext)
+    {
+      repo_empty (repo, 1);
+      if (repo_add_solv (repo, fp, SOLV_ADD_NO_STUBS))
+        {
+          g_warning ("Could not add solvables from cache file");
+          return;
+        }
+    }
+  else
+    {
+      int flags = REPO_USE_LOADING | REPO_EXTEND_SOLVABLES | REPO_LOCALPOOL;
+      /* make sure repodata contains complete repo */
+      /* (this is how repodata_write saves it) */
+      repodata_extend_block (repodata, repo->start, repo->end - repo->start);
+      repodata->state = REPODATA_LOADING;
+      repo_add_solv (repo, fp, flags);
+      repodata->state = REPODATA_AVAILABLE; /* in case the load failed */
+    }
+
+  fclose (fp);
+}
+
+/* Solvable keys the depsolving actually reads */
+static const Id depsolve_keys[] = {
+  SOLVABLE_NAME,
+  SOLVABLE_ARCH,
+  SOLVABLE_EVR,
+  SOLVABLE_VENDOR,
+  SOLVABLE_PROVIDES,
+  SOLVABLE_OBSOLETES,
+  SOLVABLE_CONFLICTS,
+  SOLVABLE_REQUIRES,
+  SOLVABLE_RECOMMENDS,
+  SOLVABLE_SUGGESTS,
+  SOLVABLE_SUPPLEMENTS,
+  SOLVABLE_ENHANCES,
+  SOLVABLE_SOURCENAME,
+  SOLVABLE_SOURCEEVR,
+  SOLVABLE_SOURCEARCH,
+  /* Location of the package */
+  SOLVABLE_MEDIADIR,
+  SOLVABLE_MEDIAFILE,
+  SOLVABLE_MEDIANR,
+  /* Primary lists the files other packages commonly depend on */
+  SOLVABLE_FILELIST,
+  /* Needed to match filelists to the packages when they are loaded */
+  SOLVABLE_CHECKSUM,
+  SOLVABLE_PKGID,
+  0
+};
+
+/* Packages of provides-only lookaside repos are never part of the result,
+ * they only need to satisfy dependencies */
+static const Id provides_keys[] = {
+  SOLVABLE_NAME,
+  SOLVABLE_ARCH,
+  SOLVABLE_EVR,
+  SOLVABLE_PROVIDES,
+  SOLVABLE_OBSOLETES,
+  SOLVABLE_CONFLICTS,
+  SOLVABLE_REQUIRES,
+  /* Only the file provides listed in primary */
+  SOLVABLE_FILELIST,
+  0
+};
+
+/*
+ * Only keep the solvable keys listed in @kfdata, dropping everything which
+ * is only informative, such as summaries, descriptions and URLs. Repository
+ * metadata, including the filelists stubs, are kept.
+ */
+static int
+depsolve_keyfilter (Repo    *repo,
+                    Repokey *key,
+                    void    *kfdata)
+{
+  if (g_str_has_prefix (pool_id2str (repo->pool, key->name), "repository:"))
+    return repo_write_stdkeyfilter (repo, key, NULL);
+
+  for (const Id *k = kfdata; *k; k++)
+    if (key->name == *k)
+      return repo_write_stdkeyfilter (repo, key, NULL);
+
+  /* Matched to the solvables of all repos whenever they are loaded */
+  const char *name = pool_id2str (repo->pool, key->name);
+  if (g_strcmp0 (name, ARTIFACTS_KEY) == 0 || g_strcmp0 (name, DEFAULTS_KEY) == 0)
+    return repo_write_stdkeyfilter (repo, key, NULL);
+
+  return KEY_STORAGE_DROPPED;
+}
+
+/*
+ * Write @repo, or its @repodata, to @cachename. If @keys is given, only
+ * those solvable keys are written, and as the repo is switched to the cache
+ * afterwards, the rest is released from memory as well.
+ */
+static gboolean
+write_repo_cache (Repo         *repo,
+                  Repodata     *repodata,
+                  const char   *repoext,
+                  const Id     *keys,
+                  const gchar  *cachename)
+{
+  g_autofree gchar *tmpname = NULL;
+  FILE *fp = cache_file_create (cachename, &tmpname);
+  if (!fp)
+    {
+      g_warning ("Could not open cache file %s: %s", cachename, g_strerror (errno));
+      return FALSE;
+    }
+
+  if (repodata)
+    repodata_write (repodata, fp);
+  else if (keys)
+    repo_write_filtered (repo, fp, depsolve_keyfilter, (void *) keys, NULL);
+  else
+    repo_write (repo, fp); /* main repo */
+
+  g_autoptr(GError) error = NULL;
+  if (!cache_file_commit (fp, tmpname, cachename, &error))
+    {
+      g_warning ("%s", error->message);
+      return FALSE;
+    }
+
+  /* Switch to just saved repo to activate paging and save memory */
+  switch_to_cached_repo (repo, repodata, repoext, cachename);
+
+  return TRUE;
+}
+
+static gboolean
+load_cached_repo (Repo       *repo,
+                  const char *cachefn,
+                  const char *repoext)
+{
+  int ret, flags = 0;
+
+  if (!g_file_test (cachefn, G_FILE_TEST_IS_REGULAR))
+    {
+      g_debug ("Cache %s for repo %s not found", cachefn, repo->name);
+      return FALSE;
+    }
+
+  FILE *fp = cache_file_open (cachefn);
+  if (!fp)
+    return FALSE;
+
+  if (repoext)
+    flags = REPO_USE_LOADING | REPO_EXTEND_SOLVABLES | REPO_LOCALPOOL;
+
+  ret = repo_add_solv (repo, fp, flags);
+  fclose (fp);
+
+  return ret == 0;
+}
+
+/* Add the file paths @dep refers to, including those inside rich deps */
+static void
+add_file_dep (Pool       *pool,
+              Id          dep,
+              GHashTable *paths)
+{
+  while (ISRELDEP (dep))
+    {
+      Reldep *rd = GETRELDEP (pool, dep);
+      if (rd->flags == REL_AND || rd->flags == REL_OR || rd->flags == REL_COND ||
+          rd->flags == REL_UNLESS || rd->flags == REL_WITH || rd->flags == REL_WITHOUT ||
+          rd->flags == REL_ELSE)
+        add_file_dep (pool, rd->evr, paths);
+      else if (rd->flags >= 8)
+        return;
+      dep = rd->name;
+    }
+
+  const char *str = pool_id2str (pool, dep);
+  if (str[0] == '/')
+    g_hash_table_add (paths, (gpointer) str);
+}
+
+/* Paths of all the files which are depended on in @pool, which are the only
+ * ones pool_addfileprovides() looks up */
+static GHashTable *
+collect_file_deps (Pool *pool)
+{
+  GHashTable *paths = g_hash_table_new (g_str_hash, g_str_equal);
+  Solvable *s;
+  Id p;
+
+  FOR_POOL_SOLVABLES (p)
+    {
+      s = pool_id2solvable (pool, p);
+      Offset deps[] = { s->requires, s->conflicts, s->obsoletes, s->recommends,
+                        s->suggests, s->supplements, s->enhances };
+      for (unsigned int i = 0; i < G_N_ELEMENTS (deps); i++)
+        if (deps[i])
+          for (Id *dp = s->repo->idarraydata + deps[i]; *dp; dp++)
+            add_file_dep (pool, *dp, paths);
+    }
+
+  g_debug ("%u file paths are depended on", g_hash_table_size (paths));
+  return paths;
+}
+
+void
+filelists_loader_clear (FilelistsLoader *loader)
+{
+  g_clear_pointer (&loader->file_deps, g_hash_table_unref);
+}
+
+/* Read the paths covered by a filelists index */
+static GHashTable *
+read_index_paths (const char *listfn)
+{
+  g_autofree gchar *contents = NULL;
+  if (!g_file_get_contents (listfn, &contents, NULL, NULL))
+    return NULL;
+
+  GHashTable *paths = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  g_auto(GStrv) lines = g_strsplit (contents, "\n", -1);
+  for (GStrv line = lines; *line; line++)
+    if (**line)
+      g_hash_table_add (paths, g_strdup (*line));
+
+  return paths;
+}
+
+static gboolean
+write_index_paths (const char  *listfn,
+                   GHashTable  *paths)
+{
+  g_autoptr(GString) contents = g_string_new (NULL);
+  GHashTableIter iter;
+  gpointer path;
+
+  g_hash_table_iter_init (&iter, paths);
+  while (g_hash_table_iter_next (&iter, &path, NULL))
+    g_string_append_printf (contents, "%s\n", (const char *) path);
+
+  g_autoptr(GError) error = NULL;
+  if (!g_file_set_contents (listfn, contents->str, contents->len, &error))
+    {
+      g_warning ("Could not write %s: %s", listfn, error->message);
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+typedef struct
+{
+  GHashTable *paths;
+  GArray     *files;
+} IndexSearch;
+
+typedef struct
+{
+  Id     p;
+  gchar *path;
+} IndexedFile;
+
+static int
+index_search_cb (void      *cbdata,
+                 Solvable  *s,
+                 Repodata  *data,
+                 Repokey   *key,
+                 KeyValue  *kv)
+{
+  IndexSearch *search = cbdata;
+
+  if (g_hash_table_contains (search->paths, kv->str))
+    {
+      IndexedFile file = { s - s->repo->pool->solvables, g_strdup (kv->str) };
+      g_array_append_val (search->files, file);
+    }
+
+  return 0;
+}
+
+/*
+ * Replace the complete filelists loaded into @data by the entries of the
+ * files in @paths.
+ */
+static void
+repodata_filter_filelists (Repo       *repo,
+                           Repodata   *data,
+                           GHashTable *paths)
+{
+  IndexSearch search = { paths, g_array_new (FALSE, FALSE, sizeof (IndexedFile)) };
+
+  for (Id p = repo->start; p < repo->end; p++)
+    repodata_search (data, p, SOLVABLE_FILELIST, SEARCH_FILES | SEARCH_COMPLETE_FILELIST,
+                     index_search_cb, &search);
+
+  /* @data is the repodata being loaded, which this empties for it to be
+   * filled again with only the indexed files */
+  repo_add_repodata (repo, REPO_USE_LOADING | REPO_LOCALPOOL);
+  repodata_extend_block (data, repo->start, repo->end - repo->start);
+
+  for (guint i = 0; i < search.files->len; i++)
+    {
+      IndexedFile *file = &g_array_index (search.files, IndexedFile, i);
+      gchar *base = strrchr (file->path, '/');
+      *base++ = '\0';
+      Id did = repodata_str2dir (data, *file->path ? file->path : "/", 1);
+      repodata_add_dirstr (data, file->p, SOLVABLE_FILELIST, did, base);
+      g_free (file->path);
+    }
+  g_array_free (search.files, TRUE);
+
+  repodata_internalize (data);
+}
+
+/**
+ * filelist_loadcb:
+ * @pool: the pool
+ * @data: filelists stub of a repo
+ * @cdata: the #FilelistsLoader
+ *
+ * Load the filelists of a repo. Unless complete filelists were asked for,
+ * only the files other packages in the pool depend on are loaded. Those are
+ * cached as an index next to the main cache, together with the list of
+ * paths it was built for, and it's only built again if more paths are
+ * needed.
+ *
+ * Returns: 1 if the filelists were loaded, 0 otherwise
+ */
+int
+filelist_loadcb (Pool     *pool,
+                 Repodata *data,
+                 void     *cdata)
+{
   FILE *fp;
+  const char *path, *type, *fname;
+  Repo *repo = data->repo;
+  FilelistsLoader *loader = cdata;
 
-  if (!repoext && repodata)
-    return;
+  type = repodata_lookup_str (data, SOLVID_META, REPOSITORY_REPOMD_TYPE);
+  if (g_strcmp0 (type, "filelists") != 0)
+    return 0;
 
-  for (i = repo->start; i < repo->end; i++)
-    if (repo->pool->solvables[i].repo != repo)
-      break;
+  g_autofree gchar *cachedir = get_repo_cachedir (repo->name);
+  g_autoptr(GHashTable) paths = NULL;
+  g_autofree gchar *listfn = NULL;
 
-  if (i < repo->end)
-    return; /* not a simple block */
+  /* complete filelists cache name is $(CHECKSUM(REPOMD)).solvx, the index
+   * is $(CHECKSUM(REPOMD))-files.solvx */
+  const char *cachefn = pool_tmpjoin (pool, cachedir, "/", repo->appdata);
+  if (!loader->options->full_filelists)
+    {
+      cachefn = pool_tmpappend (pool, cachefn, "-files.solvx", 0);
+      listfn = g_strconcat (cachedir, "/", repo->appdata, "-files.list", NULL);
+
+      if (!loader->file_deps)
+        loader->file_deps = collect_file_deps (pool);
+
+      paths = read_index_paths (listfn);
+      gboolean covered = paths != NULL;
+      GHashTableIter iter;
+      gpointer file;
+      if (!paths)
+        paths = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+      g_hash_table_iter_init (&iter, loader->file_deps);
+      while (g_hash_table_iter_next (&iter, &file, NULL))
+        if (!g_hash_table_contains (paths, file))
+          {
+            covered = FALSE;
+            g_hash_table_add (paths, g_strdup (file));
+          }
+
+      if (covered && load_cached_repo (repo, cachefn, type))
+        {
+          g_debug ("Using cached filelists index for \"%s\"", repo->name);
+          return 1;
+        }
+    }
+  else
+    {
+      cachefn = pool_tmpappend (pool, cachefn, ".solvx", 0);
+      if (load_cached_repo (repo, cachefn, type))
+        {
+          g_debug ("Using cached repo for \"%s\" filelists", repo->name);
+          return 1;
+        }
+    }
+  /* The pool's temporary buffers get reused by what follows */
+  g_autofree gchar *cachepath = g_strdup (cachefn);
+
+  path = repodata_lookup_str (data, SOLVID_META, REPOSITORY_REPOMD_LOCATION);
+  if (!path)
+    return 0;
+
+  fname = download_repo_metadata (loader->session, repo, type, path, cachedir);
+  fp = solv_xfopen (fname, 0);
+  if (!fp)
+    {
+      g_warning ("Could not open filelists %s: %s", fname, g_strerror (errno));
+      return 0;
+    }
+  repo_add_rpmmd (repo, fp, NULL, REPO_USE_LOADING | REPO_LOCALPOOL | REPO_EXTEND_SOLVABLES);
+  fclose (fp);
+
+  if (paths)
+    repodata_filter_filelists (repo, data, paths);
+
+  /* The list is written last, so that it never refers to a missing index */
+  if (write_repo_cache (repo, data, type, NULL, cachepath))
+    {
+      g_debug ("Wrote cache file %s for repo \"%s\"", cachepath, repo->name);
+      if (listfn)
+        write_index_paths (listfn, paths);
+    }
+
+  return 1;
+}
+
+/* Version of what goes into the main cache, part of its name so that caches
+ * written differently by older versions are never loaded. Version 2 keeps
+ * the artifacts of modules instead of their dependencies on the packages. */
+#define REPO_CACHE_VERSION "2"
+
+/* Name of the main cache file, which is $(CHECKSUM(REPOMD))-v$(VERSION).solv,
+ * or $(CHECKSUM(REPOMD))-provides-v$(VERSION).solv for provides-only repos */
+static gchar *
+repo_cache_path (const char *cachedir,
+                 const char *mdchksum,
+                 gboolean    provides_only)
+{
+  return g_strconcat (cachedir, "/", mdchksum, provides_only ? "-provides" : "",
+                      "-v" REPO_CACHE_VERSION ".solv", NULL);
+}
+
+/* Name of the cache file of comps, which are kept out of the main one */
+static gchar *
+comps_cache_path (const char *cachedir,
+                  const char *mdchksum)
+{
+  return g_strconcat (cachedir, "/", mdchksum, "-comps.solv", NULL);
+}
+
+/*
+ * Comps are only needed when the input refers to groups or categories, so
+ * they are not part of the main repo cache and only loaded on request.
+ * Unlike filelists they add solvables rather than extend them, which is why
+ * the pool load callback can't be used for them.
+ */
+static void
+repo_load_comps (Repo        *repo,
+                 SoupSession *session,
+                 const char  *path,
+                 const char  *cachedir,
+                 const char  *repomdpath)
+{
+  Pool *pool = repo->pool;
+  g_autofree gchar *cachefn = comps_cache_path (cachedir, repo->appdata);
+  if (load_cached_repo (repo, cachefn, NULL))
+    {
+      g_debug ("Using cached comps for \"%s\"", repo->name);
+      return;
+    }
+
+  FILE *fp = solv_xfopen (repomdpath, "r");
+  if (!fp)
+    return;
+  Repo *mdrepo = repo_create (pool, "repomd");
+  repo_add_repomdxml (mdrepo, fp, 0);
+  fclose (fp);
+
+  const char *fname = download_repo_metadata (session, mdrepo, "group_gz", path, cachedir);
+  if (!fname)
+    fname = download_repo_metadata (session, mdrepo, "group", path, cachedir);
+  g_autofree gchar *compspath = g_strdup (fname);
+  repo_free (mdrepo, 1);
 
-  fp = g_fopen (cachepath, "rb");
+  fp = solv_xfopen (compspath, "r");
   if (!fp)
     return;
 
-  /* main repo */
-  if (!repoext)
+  /* Parsed on their own first, so that the cache holds nothing else */
+  Repo *comps = repo_create (pool, "comps");
+  repo_add_comps (comps, fp, 0);
+  fclose (fp);
+  gboolean cached = write_repo_cache (comps, NULL, NULL, NULL, cachefn);
+  repo_free (comps, 1);
+
+  if (cached && load_cached_repo (repo, cachefn, NULL))
     {
-      repo_empty (repo, 1);
-      if (repo_add_solv (repo, fp, SOLV_ADD_NO_STUBS))
+      g_debug ("Wrote cache file %s for repo \"%s\" comps", cachefn, repo->name);
+      return;
+    }
+
+  fp = solv_xfopen (compspath, "r");
+  if (fp)
+    {
+      repo_add_comps (repo, fp, 0);
+      fclose (fp);
+    }
+}
+
+static gboolean
+metadata_is_fresh (const char *path,
+                   gint        expire)
+{
+  GStatBuf st;
+  if (expire <= 0 || g_stat (path, &st) == -1)
+    return FALSE;
+
+  return g_get_real_time () / G_USEC_PER_SEC - st.st_mtime < expire;
+}
+
+/* Metadata create_repo may load, in the order it loads them */
+static const char *repo_metadata_types[] = { "primary", "group_gz", "group", "modules", NULL };
+
+/* Get the mirrors of a repo given as a mirror list, best first */
+static GPtrArray *
+resolve_repo_mirrors (SoupSession       *session,
+                      const char        *name,
+                      const char        *spec,
+                      const FusOptions  *options,
+                      GError           **error)
+{
+  g_autofree gchar *cachedir = get_repo_cachedir (name);
+  if (g_mkdir_with_parents (cachedir, 0700) == -1)
+    {
+      g_set_error (error,
+                   G_OPTION_ERROR, G_OPTION_ERROR_FAILED,
+                   "Could not create cache dir %s: %s",
+                   cachedir, g_strerror (errno));
+      return NULL;
+    }
+
+  /* The ranking is reused for as long as repomd.xml would be */
+  g_autofree gchar *mirrorspath = g_build_filename (cachedir, "mirrors", NULL);
+  g_autoptr(GPtrArray) cached = mirrors_load (mirrorspath);
+  if (cached && (!session || metadata_is_fresh (mirrorspath, options->metadata_expire)))
+    return g_steal_pointer (&cached);
+
+  if (!session)
+    {
+      g_set_error (error,
+                   G_OPTION_ERROR, G_OPTION_ERROR_FAILED,
+                   "No cached mirrors for repo %s", name);
+      return NULL;
+    }
+
+  const char *url = strchr (spec, '=') + 1;
+  g_autofree gchar *listpath = g_build_filename (cachedir, "mirrorlist", NULL);
+  g_autofree gchar *contents = NULL;
+  gsize len;
+  g_autoptr(GError) e = NULL;
+  if (!download_to_path (session, url, listpath, 0, NULL, &e) ||
+      !g_file_get_contents (listpath, &contents, &len, &e))
+    {
+      /* Stale mirrors are better than none */
+      if (cached)
         {
-          g_warning ("Could not add solvables from cache file");
-          return;
+          g_warning ("Could not download %s, using cached mirrors: %s", url, e->message);
+          return g_steal_pointer (&cached);
         }
+      g_propagate_prefixed_error (error, g_steal_pointer (&e), "Could not download %s: ", url);
+      return NULL;
     }
-  else
+
+  g_autoptr(GPtrArray) mirrors = mirrors_parse (spec, contents, len, error);
+  if (!mirrors)
     {
-      int flags = REPO_USE_LOADING | REPO_EXTEND_SOLVABLES | REPO_LOCALPOOL;
-      /* make sure repodata contains complete repo */
-      /* (this is how repodata_write saves it) */
-      repodata_extend_block (repodata, repo->start, repo->end - repo->start);
-      repodata->state = REPODATA_LOADING;
-      repo_add_solv (repo, fp, flags);
-      repodata->state = REPODATA_AVAILABLE; /* in case the load failed */
+      g_prefix_error (error, "Could not parse %s: ", url);
+      return NULL;
+    }
+
+  mirrors_rank (session, mirrors, options->parallel_downloads, cachedir);
+
+  if (!mirrors_save (mirrorspath, mirrors, &e))
+    g_debug ("Could not save mirrors of repo %s: %s", name, e->message);
+
+  return g_steal_pointer (&mirrors);
+}
+
+/**
+ * resolve_repos_mirrors:
+ * @session: session used for downloading, or %NULL to only use the cache
+ * @repos: array of repo specs, each one split into (name, type, path)
+ * @options: download settings
+ * @error: return location for a #GError
+ *
+ * For each repo whose path is a mirror list or metalink, rank its mirrors
+ * and replace the path with the URL of the best one. The ranking is saved
+ * in the repo cache dir, so that downloads can fall back to the other
+ * mirrors later.
+ *
+ * Returns: %FALSE if the mirrors of any repo could not be determined
+ */
+gboolean
+resolve_repos_mirrors (SoupSession       *session,
+                       GPtrArray         *repos,
+                       const FusOptions  *options,
+                       GError           **error)
+{
+  for (unsigned int i = 0; i < repos->len; i++)
+    {
+      GStrv strv = g_ptr_array_index (repos, i);
+      if (g_strv_length (strv) < 3)
+        continue;
+
+      /* Mirrors saved while the repo was given as a mirror list would
+       * otherwise be used as fallbacks by repo_download_new() */
+      if (!mirrors_spec_is_list (strv[2]))
+        {
+          g_autofree gchar *cachedir = get_repo_cachedir (strv[0]);
+          g_autofree gchar *mirrorspath = g_build_filename (cachedir, "mirrors", NULL);
+          if (g_unlink (mirrorspath) == 0)
+            g_debug ("Dropped mirrors of repo \"%s\", it's not a mirror list anymore", strv[0]);
+          continue;
+        }
+
+      g_autoptr(GPtrArray) mirrors = resolve_repo_mirrors (session, strv[0], strv[2], options, error);
+      if (!mirrors)
+        return FALSE;
+
+      g_debug ("Using mirror %s for repo \"%s\"",
+               (const char *) g_ptr_array_index (mirrors, 0), strv[0]);
+      g_free (strv[2]);
+      strv[2] = g_strdup (g_ptr_array_index (mirrors, 0));
+    }
+
+  return TRUE;
+}
+
+static void
+close_fd (gpointer fd)
+{
+  close (*(int *) fd);
+}
+
+static gint
+compare_names (gconstpointer a,
+               gconstpointer b)
+{
+  return g_strcmp0 (*(const char **) a, *(const char **) b);
+}
+
+/**
+ * lock_repo_caches:
+ * @repos: array of repo specs
+ * @error: return location for a #GError
+ *
+ * Lock the cache dirs of all @repos, so that processes sharing the cache
+ * don't download and write the same files at the same time: whoever gets
+ * the lock first fills the cache, and the others wait and then use what it
+ * wrote. The locks are taken in the order of the repo names, which can't
+ * deadlock with other processes using overlapping sets of repos.
+ *
+ * Returns: (transfer full): array of file descriptors holding the locks,
+ *   which are released when it's freed, or %NULL on error
+ */
+GArray *
+lock_repo_caches (GPtrArray  *repos,
+                  GError    **error)
+{
+  g_autoptr(GPtrArray) names = g_ptr_array_new ();
+  for (unsigned int i = 0; i < repos->len; i++)
+    g_ptr_array_add (names, ((GStrv) g_ptr_array_index (repos, i))[0]);
+  g_ptr_array_sort (names, compare_names);
+
+  g_autoptr(GArray) locks = g_array_new (FALSE, FALSE, sizeof (int));
+  g_array_set_clear_func (locks, close_fd);
+
+  for (unsigned int i = 0; i < names->len; i++)
+    {
+      const char *name = g_ptr_array_index (names, i);
+      /* A lock can't be taken twice */
+      if (i > 0 && g_strcmp0 (name, g_ptr_array_index (names, i - 1)) == 0)
+        continue;
+
+      g_autofree gchar *cachedir = get_repo_cachedir (name);
+      if (g_mkdir_with_parents (cachedir, 0700) == -1)
+        {
+          g_set_error (error,
+                       G_OPTION_ERROR, G_OPTION_ERROR_FAILED,
+                       "Could not create cache dir %s: %s",
+                       cachedir, g_strerror (errno));
+          return NULL;
+        }
+
+      int fd = cache_lock (cachedir, error);
+      if (fd == -1)
+        return NULL;
+      g_array_append_val (locks, fd);
+    }
+
+  return g_steal_pointer (&locks);
+}
+
+/**
+ * fetch_repos_metadata:
+ * @session: session used for downloading
+ * @repos: array of repo specs, each one split into (name, type, path)
+ * @with_comps: whether comps will be loaded too
+ * @options: download settings
+ * @error: return location for a #GError
+ *
+ * Download repomd.xml of all @repos concurrently, and then, again
+ * concurrently, all the metadata create_repo needs which are not in the cache
+ * yet. Nothing is parsed into a pool here, so that create_repo can be called
+ * for each repo afterwards in a deterministic order.
+ *
+ * A cached repomd.xml younger than the metadata expiration time is used as
+ * is. Otherwise it's only downloaded again if the server says it changed.
+ *
+ * Returns: %FALSE if any repomd.xml could not be downloaded
+ */
+gboolean
+fetch_repos_metadata (SoupSession       *session,
+                      GPtrArray         *repos,
+                      gboolean           with_comps,
+                      const FusOptions  *options,
+                      GError           **error)
+{
+  g_autoptr(GPtrArray) downloads = g_ptr_array_new_with_free_func ((GDestroyNotify) download_free);
+
+  for (unsigned int i = 0; i < repos->len; i++)
+    {
+      GStrv strv = g_ptr_array_index (repos, i);
+      g_autofree gchar *cachedir = get_repo_cachedir (strv[0]);
+      g_autofree gchar *destdir = g_build_filename (cachedir, "repodata", NULL);
+      if (g_mkdir_with_parents (destdir, 0700) == -1)
+        {
+          g_set_error (error,
+                       G_OPTION_ERROR, G_OPTION_ERROR_FAILED,
+                       "Could not create cache dir %s: %s",
+                       destdir, g_strerror (errno));
+          return FALSE;
+        }
+
+      /* Local repos are read in place, nothing to download, and modular
+       * repos are always local */
+      if (repo_is_local (strv[2]) || g_strcmp0 (strv[1], MODULAR_TYPE) == 0)
+        continue;
+
+      g_autofree gchar *fname = g_build_filename (destdir, "repomd.xml", NULL);
+      if (metadata_is_fresh (fname, options->metadata_expire))
+        {
+          g_debug ("Cached repomd.xml for repo \"%s\" has not expired yet", strv[0]);
+          continue;
+        }
+
+      Download *dl = repo_download_new (strv[2], cachedir, "repodata/repomd.xml", fname);
+      dl->conditional = TRUE;
+      g_ptr_array_add (downloads, dl);
+    }
+
+  download_all (session, downloads, options->parallel_downloads);
+
+  for (unsigned int i = 0; i < downloads->len; i++)
+    {
+      Download *dl = g_ptr_array_index (downloads, i);
+      if (dl->error)
+        {
+          g_propagate_prefixed_error (error, g_steal_pointer (&dl->error),
+                                      "Could not download %s: ", dl->url);
+          return FALSE;
+        }
     }
 
-  fclose (fp);
-}
+  /* repomd.xml files are parsed into a throwaway pool only to find out what
+   * else needs to be downloaded. */
+  g_autoptr(Pool) pool = pool_create ();
+  g_ptr_array_set_size (downloads, 0);
 
-static gboolean
-write_repo_cache (Repo         *repo,
-                  Repodata     *repodata,
-                  const char   *repoext,
-                  const gchar  *cachename)
-{
-  FILE *fp = g_fopen (cachename, "wb");
-  if (!fp)
+  for (unsigned int i = 0; i < repos->len; i++)
     {
-      g_warning ("Could not open cache file %s: %s", cachename, g_strerror (errno));
-      return FALSE;
+      GStrv strv = g_ptr_array_index (repos, i);
+      if (repo_is_local (strv[2]) || g_strcmp0 (strv[1], MODULAR_TYPE) == 0)
+        continue;
+
+      g_autofree gchar *cachedir = get_repo_cachedir (strv[0]);
+      g_autofree gchar *fname = g_build_filename (cachedir, "repodata", "repomd.xml", NULL);
+
+      /* Nothing else is needed if the repo is already cached */
+      g_autofree gchar *mdchksum = chksum_string_for_filepath (REPOKEY_TYPE_SHA256, fname);
+      if (!mdchksum)
+        continue;
+      gboolean provides_only = g_strcmp0 (strv[1], LOOKASIDE_PROVIDES_TYPE) == 0;
+      g_autofree gchar *cachefn = repo_cache_path (cachedir, mdchksum, provides_only);
+      g_autofree gchar *compsfn = comps_cache_path (cachedir, mdchksum);
+      gboolean need_main = !g_file_test (cachefn, G_FILE_TEST_IS_REGULAR);
+      gboolean need_comps = with_comps && !provides_only &&
+                            !g_file_test (compsfn, G_FILE_TEST_IS_REGULAR);
+      if (!need_main && !need_comps)
+        continue;
+
+      FILE *fp = solv_xfopen (fname, "r");
+      if (!fp)
+        continue;
+      Repo *repo = repo_create (pool, strv[0]);
+      repo_add_repomdxml (repo, fp, 0);
+      fclose (fp);
+
+      for (const char **type = repo_metadata_types; *type; type++)
+        {
+          if (g_str_has_prefix (*type, "group") ? !need_comps : !need_main)
+            continue;
+          /* Provides-only repos only ever need primary */
+          if (provides_only && g_strcmp0 (*type, "primary") != 0)
+            continue;
+
+          Id chksumtype;
+          const unsigned char *chksum;
+          const char *mdname = repomd_find_file (repo, *type, TRUE, &chksum, &chksumtype);
+          if (!mdname)
+            continue;
+
+          /* group is only a fallback for group_gz */
+          if (g_strcmp0 (*type, "group_gz") == 0)
+            type++;
+
+          const char *fpath = pool_tmpjoin (pool, cachedir, "/", mdname);
+          g_autofree gchar *stamppath = g_strconcat (fpath, ".stamp", NULL);
+          if (g_file_test (fpath, G_FILE_TEST_IS_REGULAR) &&
+              checksum_matches (fpath, stamppath, chksum, chksumtype))
+            continue;
+
+          /* Incremental downloads are done one at a time, as each of them
+           * is a series of requests. If one fails, the whole file is
+           * downloaded together with the others.
+           */
+          g_autoptr(Download) dl = repo_download_new (strv[2], cachedir, mdname, fpath);
+          download_set_checksum (dl, chksumtype, chksum);
+          g_autofree gchar *seed = find_zck_seed (fpath);
+          if (seed)
+            {
+              g_autoptr(GError) e = NULL;
+              if (download_zck (session, dl, seed, &e))
+                {
+                  stamp_write (fpath, stamppath, chksum, chksumtype);
+                  continue;
+                }
+              g_debug ("Could not download %s incrementally: %s", dl->url, e->message);
+            }
+
+          /* create_repo parses primary while downloading it */
+          if (options->stream_metadata && g_strcmp0 (*type, "primary") == 0)
+            continue;
+
+          g_ptr_array_add (downloads, g_steal_pointer (&dl));
+        }
     }
 
-  if (!repodata)
-    repo_write (repo, fp); /* main repo */
-  else
-    repodata_write (repodata, fp);
+  download_all (session, downloads, options->parallel_downloads);
 
-  if (fclose (fp))
+  /* Failures are not fatal here, create_repo will try again */
+  for (unsigned int i = 0; i < downloads->len; i++)
     {
-      g_warning ("Error when closing %s: %s", cachename, g_strerror (errno));
-      g_unlink (cachename);
-      return FALSE;
+      Download *dl = g_ptr_array_index (downloads, i);
+      if (dl->error)
+        g_debug ("Could not download %s: %s", dl->url, dl->error->message);
+      else
+        {
+          g_autofree gchar *stamppath = g_strconcat (dl->path, ".stamp", NULL);
+          stamp_write (dl->path, stamppath,
+                       solv_chksum_get (dl->expected, NULL),
+                       solv_chksum_get_type (dl->expected));
+        }
     }
 
-  /* Switch to just saved repo to activate paging and save memory */
-  switch_to_cached_repo (repo, repodata, repoext, cachename);
-
   return TRUE;
 }
 
+typedef struct
+{
+  const char *mdchksum;
+  gchar      *repomd;
+} RepoCacheKeep;
+
 static gboolean
-load_cached_repo (Repo       *repo,
-                  const char *cachefn,
-                  const char *repoext)
+repo_cache_keep (const char *relpath,
+                 gpointer    user_data)
 {
-  int ret, flags = 0;
+  RepoCacheKeep *keep = user_data;
+  g_autofree gchar *dir = g_path_get_dirname (relpath);
+  g_autofree gchar *base = g_path_get_basename (relpath);
 
-  if (!g_file_test (cachefn, G_FILE_TEST_IS_REGULAR))
-    {
-      g_debug ("Cache %s for repo %s not found", cachefn, repo->name);
-      return FALSE;
-    }
+  /* Caches of the current metadata, the mirrors and the lock */
+  if (g_strcmp0 (dir, ".") == 0)
+    return g_str_has_prefix (base, keep->mdchksum) ||
+           g_str_has_prefix (base, "mirror") ||
+           g_strcmp0 (base, "lock") == 0;
 
-  FILE *fp = g_fopen (cachefn, "rb");
-  if (!fp)
+  if (g_strcmp0 (dir, "repodata") != 0)
     return FALSE;
+  if (g_str_has_prefix (base, "repomd.xml"))
+    return TRUE;
+
+  /* Current metadata files, with their stamps and partial downloads */
+  static const char *suffixes[] = { ".stamp", ".part", ".headers", NULL };
+  for (const char **suffix = suffixes; *suffix; suffix++)
+    if (g_str_has_suffix (base, *suffix))
+      base[strlen (base) - strlen (*suffix)] = '\0';
+  return keep->repomd && strstr (keep->repomd, base) != NULL;
+}
 
-  if (repoext)
-    flags = REPO_USE_LOADING | REPO_EXTEND_SOLVABLES | REPO_LOCALPOOL;
+/* Evict what is not used by @repo from its cache dir, if asked to */
+static void
+repo_cache_gc (Repo              *repo,
+               const char        *cachedir,
+               const char        *repomdpath,
+               const FusOptions  *options)
+{
+  if (!options->cache_max_size && !options->cache_max_age)
+    return;
 
-  ret = repo_add_solv (repo, fp, flags);
-  fclose (fp);
+  /* Modular repos have no repomd.xml, only caches named after the checksum */
+  RepoCacheKeep keep = { repo->appdata, NULL };
+  if (repomdpath && !g_file_get_contents (repomdpath, &keep.repomd, NULL, NULL))
+    return;
 
-  return ret == 0;
+  cache_gc (cachedir, repo_cache_keep, &keep, options->cache_max_size, options->cache_max_age);
+  g_free (keep.repomd);
 }
 
-static inline gchar *
-get_repo_cachedir (const char *name)
+/**
+ * create_modular_repo:
+ * @pool: the pool
+ * @name: name of the repo
+ * @path: local modulemd file, possibly compressed
+ * @options: fus options
+ * @error: return location for a #GError
+ *
+ * Load modules from a bare modulemd file rather than from the modules
+ * metadata of a repo. What was loaded is cached, named after the checksum of
+ * @path, so that the YAML only gets parsed again once it changes.
+ *
+ * Returns: (transfer none): the new repo, or %NULL on error
+ */
+Repo *
+create_modular_repo (Pool              *pool,
+                     const char        *name,
+                     const char        *path,
+                     const FusOptions  *options,
+                     GError           **error)
 {
-  return g_build_filename (g_get_user_cache_dir (), "fus", name, NULL);
-}
+  if (!repo_is_local (path))
+    {
+      g_set_error (error,
+                   G_OPTION_ERROR, G_OPTION_ERROR_FAILED,
+                   "Modular repo %s must be a local file", name);
+      return NULL;
+    }
 
-int
-filelist_loadcb (Pool     *pool,
-                 Repodata *data,
-                 void     *cdata)
-{
-  FILE *fp;
-  const char *path, *type, *fname;
-  Repo *repo = data->repo;
-  SoupSession *session = (SoupSession *) cdata;
+  g_autofree gchar *cachedir = get_repo_cachedir (name);
+  if (g_mkdir_with_parents (cachedir, 0700) == -1)
+    {
+      g_set_error (error,
+                   G_OPTION_ERROR, G_OPTION_ERROR_FAILED,
+                   "Could not create cache dir %s: %s",
+                   cachedir, g_strerror (errno));
+      return NULL;
+    }
 
-  type = repodata_lookup_str (data, SOLVID_META, REPOSITORY_REPOMD_TYPE);
-  if (g_strcmp0 (type, "filelists") != 0)
-    return 0;
+  gchar *mdchksum = chksum_string_for_filepath (REPOKEY_TYPE_SHA256, path);
+  if (!mdchksum)
+    {
+      g_set_error (error,
+                   G_OPTION_ERROR, G_OPTION_ERROR_FAILED,
+                   "Could not read %s: %s",
+                   path, g_strerror (errno));
+      return NULL;
+    }
 
-  g_autofree gchar *cachedir = get_repo_cachedir (repo->name);
+  Repo *repo = repo_create (pool, name);
+  /* Like for other repos, this names the caches */
+  repo->appdata = mdchksum;
 
-  /* repo ext cache name is $(CHECKSUM(REPOMD)).solvx */
-  const char *cachefn = pool_tmpjoin (pool, cachedir, "/", repo->appdata);
-  cachefn = pool_tmpappend (pool, cachefn, ".solvx", 0);
-  if (load_cached_repo (repo, cachefn, type))
+  g_autofree gchar *cachefn = repo_cache_path (cachedir, mdchksum, FALSE);
+  if (load_cached_repo (repo, cachefn, NULL))
     {
-      g_debug ("Using cached repo for \"%s\" filelists", repo->name);
-      return 1;
+      g_debug ("Using cached repo for \"%s\"", name);
+      repo_cache_gc (repo, cachedir, NULL, options);
+      return repo;
     }
 
-  path = repodata_lookup_str (data, SOLVID_META, REPOSITORY_REPOMD_LOCATION);
-  if (!path)
-    return 0;
-
-  fname = download_repo_metadata (session, repo, type, path, cachedir);
-  fp = solv_xfopen (fname, 0);
+  FILE *fp = solv_xfopen (path, "r");
   if (!fp)
     {
-      g_warning ("Could not open filelists %s: %s", fname, g_strerror (errno));
-      return 0;
+      g_set_error (error,
+                   G_OPTION_ERROR, G_OPTION_ERROR_FAILED,
+                   "Could not open %s: %s",
+                   path, g_strerror (errno));
+      repo_free (repo, 1);
+      g_free (mdchksum);
+      return NULL;
     }
-  repo_add_rpmmd (repo, fp, NULL, REPO_USE_LOADING | REPO_LOCALPOOL | REPO_EXTEND_SOLVABLES);
+
+  gboolean ret = repo_add_modulemd (repo, fp, NULL, 0, error);
   fclose (fp);
+  if (!ret)
+    {
+      repo_free (repo, 1);
+      g_free (mdchksum);
+      return NULL;
+    }
 
-  if (write_repo_cache (repo, data, type, cachefn))
+  if (write_repo_cache (repo, NULL, NULL, depsolve_keys, cachefn))
     g_debug ("Wrote cache file %s for repo \"%s\"", cachefn, repo->name);
 
-  return 1;
+  repo_cache_gc (repo, cachedir, NULL, options);
+
+  return repo;
 }
 
 Repo *
-create_repo (Pool         *pool,
-             SoupSession  *session,
-             const char   *name,
-             const char   *path,
-             GError      **error)
+create_repo (Pool              *pool,
+             SoupSession       *session,
+             const char        *name,
+             const char        *path,
+             gboolean           provides_only,
+             gboolean           with_comps,
+             const FusOptions  *options,
+             GError           **error)
 {
   FILE *fp;
   Id chksumtype;
   const unsigned char *chksum;
-  const char *fname, *url, *destdir;
+  const char *fname, *destdir;
 
   g_autofree gchar *cachedir = get_repo_cachedir (name);
 
@@ -736,17 +2597,15 @@ create_repo (Pool         *pool,
       return NULL;
     }
 
-  /* We can't use `download_repo_metadata` for repomd.xml because it's a
-   * special case: it's always downloaded if the path provided is a repo URL.
+  /* repomd.xml has already been downloaded by fetch_repos_metadata, together
+   * with the ones of all the other repos. When running from cache only, it's
+   * whatever was downloaded last time. Local repos are read in place.
    */
-  url = pool_tmpjoin (pool, path, "/", "repodata/repomd.xml");
-  fname = pool_tmpjoin (pool, destdir, "/", "repomd.xml");
-  if (!download_to_path (session, url, fname, error))
-    return NULL;
-
-  gchar *mdchksum = chksum_string_for_filepath (G_CHECKSUM_SHA256, fname);
-  if (!mdchksum)
-    return NULL;
+  if (repo_is_local (path))
+    fname = pool_tmpjoin (pool, path, "/", "repodata/repomd.xml");
+  else
+    fname = pool_tmpjoin (pool, destdir, "/", "repomd.xml");
+  g_autofree gchar *repomdpath = g_strdup (fname);
 
   fp = solv_xfopen (fname, "r");
   if (!fp)
@@ -758,42 +2617,78 @@ create_repo (Pool         *pool,
       return NULL;
     }
 
+  gchar *mdchksum = chksum_string_for_filepath (REPOKEY_TYPE_SHA256, fname);
+  if (!mdchksum)
+    {
+      g_set_error (error,
+                   G_OPTION_ERROR, G_OPTION_ERROR_FAILED,
+                   "Could not read repomd.xml for %s: %s",
+                   path, g_strerror (errno));
+      fclose (fp);
+      return NULL;
+    }
+
   Repo *repo = repo_create (pool, name);
   /* Save repomd checksum to the repo's appdata so we just calculate it once */
   repo->appdata = mdchksum;
 
-  /* repo main cache name is $(CHECKSUM(REPOMD)).solv */
-  const char *cachefn = pool_tmpjoin (pool, cachedir, "/", mdchksum);
-  cachefn = pool_tmpappend (pool, cachefn, ".solv", 0);
+  /* Packages of provides-only repos are not looked up by group */
+  if (provides_only)
+    with_comps = FALSE;
+
+  g_autofree gchar *cachefn = repo_cache_path (cachedir, mdchksum, provides_only);
   if (load_cached_repo (repo, cachefn, NULL))
     {
       g_debug ("Using cached repo for \"%s\"", name);
+      fclose (fp);
+      if (with_comps)
+        repo_load_comps (repo, session, path, cachedir, repomdpath);
+      repo_cache_gc (repo, cachedir, repomdpath, options);
       return repo;
     }
 
   repo_add_repomdxml (repo, fp, 0);
   fclose (fp);
 
-  fname = download_repo_metadata (session, repo, "primary", path, cachedir);
-  fp = solv_xfopen (fname, "r");
-  if (fp != NULL)
+  if (options->stream_metadata && session && !repo_is_local (path) &&
+      !repo_metadata_cached (repo, "primary", cachedir) &&
+      !repo_metadata_has_seed (repo, "primary", cachedir))
     {
-      repo_add_rpmmd (repo, fp, NULL, 0);
-      fclose (fp);
+      if (!stream_repo_primary (session, repo, path, cachedir, error))
+        {
+          repo_free (repo, 1);
+          g_free (mdchksum);
+          return NULL;
+        }
+    }
+  else
+    {
+      fname = download_repo_metadata (session, repo, "primary", path, cachedir);
+      fp = solv_xfopen (fname, "r");
+      if (fp != NULL)
+        {
+          repo_add_rpmmd (repo, fp, NULL, 0);
+          fclose (fp);
+        }
     }
 
-  fname = download_repo_metadata (session, repo, "group_gz", path, cachedir);
-  if (!fname)
-    fname = download_repo_metadata (session, repo, "group", path, cachedir);
+  /* Repos without modules skip modulemd handling entirely, and so do
+   * provides-only repos */
+  fname = provides_only ? NULL : download_repo_metadata (session, repo, "modules", path, cachedir);
   fp = solv_xfopen (fname, "r");
   if (fp != NULL)
     {
-      repo_add_comps (repo, fp, 0);
+      g_autoptr(GError) e = NULL;
+      if (!repo_add_modulemd (repo, fp, NULL, REPO_LOCALPOOL | REPO_EXTEND_SOLVABLES, &e))
+        g_warning ("Could not add modules from repo %s: %s", name, e->message);
       fclose (fp);
     }
 
-  /* filelists metadata will only be downloaded if/when needed */
-  fname = repomd_find (repo, "filelists", &chksum, &chksumtype);
+  /* filelists metadata will only be downloaded if/when needed, and never
+   * for provides-only repos, where file provides listed in primary have to
+   * be enough. The stub has to be the last repodata, which the stubs are
+   * created from if the repo can't be switched to its cache. */
+  fname = provides_only ? NULL : repomd_find (repo, "filelists", &chksum, &chksumtype);
   if (fname)
     {
       Repodata *data = repo_add_repodata (repo, 0);
@@ -808,28 +2703,340 @@ create_repo (Pool         *pool,
       repodata_internalize (data);
     }
 
-  pool_createwhatprovides (pool);
+  if (write_repo_cache (repo, NULL, NULL, provides_only ? provides_keys : depsolve_keys, cachefn))
+    g_debug ("Wrote cache file %s for repo \"%s\" filelists", cachefn, repo->name);
 
-  fname = download_repo_metadata (session, repo, "modules", path, cachedir);
-  fp = solv_xfopen (fname, "r");
-  if (fp != NULL)
+  repodata_create_stubs (repo_last_repodata (repo));
+
+  if (with_comps)
+    repo_load_comps (repo, session, path, cachedir, repomdpath);
+
+  repo_cache_gc (repo, cachedir, repomdpath, options);
+
+  return repo;
+}
+
+/* Solvable keys kept in pool snapshots. File provides have been added to
+ * the provides by then, so filelists are not needed anymore. */
+static const Id snapshot_keys[] = {
+  SOLVABLE_NAME,
+  SOLVABLE_ARCH,
+  SOLVABLE_EVR,
+  SOLVABLE_VENDOR,
+  SOLVABLE_PROVIDES,
+  SOLVABLE_OBSOLETES,
+  SOLVABLE_CONFLICTS,
+  SOLVABLE_REQUIRES,
+  SOLVABLE_RECOMMENDS,
+  SOLVABLE_SUGGESTS,
+  SOLVABLE_SUPPLEMENTS,
+  SOLVABLE_ENHANCES,
+  0
+};
+
+/* Unlike depsolve_keyfilter, this drops the repository metadata too, which
+ * would otherwise include the stubs of filelists */
+static int
+snapshot_keyfilter (Repo    *repo,
+                    Repokey *key,
+                    void    *kfdata)
+{
+  for (const Id *k = snapshot_keys; *k; k++)
+    if (key->name == *k)
+      return repo_write_stdkeyfilter (repo, key, NULL);
+
+  return KEY_STORAGE_DROPPED;
+}
+
+/**
+ * pool_snapshot_dir:
+ * @repos: array of repo specs
+ * @arch: architecture of the pool
+ * @platform: (nullable): emulated platform stream
+ * @exclude_packages: excluded packages
+ * @with_comps: whether comps are loaded
+ * @options: options the pool is loaded with
+ *
+ * Get the directory of the snapshot of a pool loaded from @repos. It's
+ * keyed by everything which affects what ends up in the pool: the checksums
+ * of the repomd.xml files, the repo types, the arch and platform and the
+ * options changing what is loaded.
+ *
+ * Returns: (transfer full): path of the snapshot, or %NULL if some repomd.xml
+ *   can't be read
+ */
+gchar *
+pool_snapshot_dir (GPtrArray         *repos,
+                   const char        *arch,
+                   const char        *platform,
+                   GStrv              exclude_packages,
+                   gboolean           with_comps,
+                   const FusOptions  *options)
+{
+  g_autoptr(GString) key = g_string_new ("fus-snapshot 1\n");
+  g_string_append_printf (key, "%s\n%s\n%d %d %d\n",
+                          arch, platform ? platform : "",
+                          with_comps, options->prune, options->full_filelists);
+  /* Excludes only change the pool when it's pruned */
+  for (GStrv exclude = exclude_packages; options->prune && exclude && *exclude; exclude++)
+    g_string_append_printf (key, "exclude %s\n", *exclude);
+
+  for (unsigned int i = 0; i < repos->len; i++)
     {
-      g_autoptr(GError) e = NULL;
-      if (!repo_add_modulemd (repo, fp, NULL, REPO_LOCALPOOL | REPO_EXTEND_SOLVABLES, &e))
-        g_warning ("Could not add modules from repo %s: %s", name, e->message);
-      fclose (fp);
+      GStrv strv = g_ptr_array_index (repos, i);
+      g_autofree gchar *cachedir = get_repo_cachedir (strv[0]);
+      g_autofree gchar *repomd = NULL;
+      if (g_strcmp0 (strv[1], MODULAR_TYPE) == 0)
+        repomd = g_strdup (strv[2]);
+      else if (repo_is_local (strv[2]))
+        repomd = g_build_filename (strv[2], "repodata", "repomd.xml", NULL);
+      else
+        repomd = g_build_filename (cachedir, "repodata", "repomd.xml", NULL);
+
+      g_autofree gchar *mdchksum = chksum_string_for_filepath (REPOKEY_TYPE_SHA256, repomd);
+      if (!mdchksum)
+        return NULL;
+      g_string_append_printf (key, "repo %s %s %s\n", strv[0], strv[1], mdchksum);
     }
 
-  pool_createwhatprovides (pool);
+  g_autofree gchar *hex = g_compute_checksum_for_string (G_CHECKSUM_SHA256, key->str, key->len);
+  return g_build_filename (g_get_user_cache_dir (), "fus", "@snapshots", hex, NULL);
+}
 
-  if (write_repo_cache (repo, NULL, NULL, cachefn))
-    g_debug ("Wrote cache file %s for repo \"%s\" filelists", cachefn, repo->name);
+static gchar *
+snapshot_repo_path (const char *dir,
+                    guint       index)
+{
+  g_autofree gchar *name = g_strdup_printf ("%u.solv", index);
+  return g_build_filename (dir, name, NULL);
+}
 
-  repodata_create_stubs (repo_last_repodata (repo));
+static void
+remove_snapshot (const char *dir)
+{
+  g_autoptr(GDir) d = g_dir_open (dir, 0, NULL);
+  const char *name;
+  while (d && (name = g_dir_read_name (d)))
+    {
+      g_autofree gchar *path = g_build_filename (dir, name, NULL);
+      g_unlink (path);
+    }
+  g_rmdir (dir);
+}
 
-  return repo;
+/* Number of snapshots kept, counting the one being written. Every change to
+ * any of the repos supersedes a snapshot, so only the most recently used
+ * ones are worth keeping. */
+#define SNAPSHOTS_KEEP 3
+
+typedef struct
+{
+  gchar *dir;
+  gint64 used;
+} SnapshotUse;
+
+static gint
+snapshot_use_cmp (gconstpointer a,
+                  gconstpointer b)
+{
+  const SnapshotUse *ua = a, *ub = b;
+  return (ub->used > ua->used) - (ub->used < ua->used);
+}
+
+/* Snapshots are removed as a whole once they haven't been used for longer
+ * than the maximum cache age, or once there are more recently used ones */
+static void
+snapshots_gc (const char *current,
+              gint64      max_age)
+{
+  g_autofree gchar *parent = g_path_get_dirname (current);
+  g_autoptr(GDir) d = g_dir_open (parent, 0, NULL);
+  g_autoptr(GArray) uses = g_array_new (FALSE, FALSE, sizeof (SnapshotUse));
+  gint64 now = g_get_real_time () / G_USEC_PER_SEC;
+  const char *name;
+
+  while (d && (name = g_dir_read_name (d)))
+    {
+      g_autofree gchar *dir = g_build_filename (parent, name, NULL);
+      g_autofree gchar *maskspath = g_build_filename (dir, "masks", NULL);
+      GStatBuf st;
+      if (g_strcmp0 (dir, current) == 0 || g_stat (maskspath, &st) == -1)
+        continue;
+      SnapshotUse use = { g_steal_pointer (&dir), MAX (st.st_atime, st.st_mtime) };
+      g_array_append_val (uses, use);
+    }
+
+  g_array_sort (uses, snapshot_use_cmp);
+  for (guint i = 0; i < uses->len; i++)
+    {
+      SnapshotUse *use = &g_array_index (uses, SnapshotUse, i);
+      if (i + 1 >= SNAPSHOTS_KEEP || (max_age && now - use->used > max_age))
+        {
+          g_debug ("Removing snapshot %s", use->dir);
+          remove_snapshot (use->dir);
+        }
+      g_free (use->dir);
+    }
+}
+
+/**
+ * pool_snapshot_load:
+ * @pool: pool without any repos, with the arch set
+ * @dir: snapshot directory from pool_snapshot_dir()
+ * @repos: array of repo specs
+ * @loaded: array the system repo and then the repos of @repos are added to
+ * @masks: selection the masked packages are added to
+ *
+ * Load a snapshot written by pool_snapshot_write(). Afterwards, only the
+ * file provides and whatprovides need to be set up.
+ *
+ * Returns: %TRUE if the snapshot was loaded, %FALSE if the pool was left
+ *   empty
+ */
+gboolean
+pool_snapshot_load (Pool        *pool,
+                    const char  *dir,
+                    GPtrArray   *repos,
+                    GPtrArray   *loaded,
+                    Queue       *masks)
+{
+  g_autofree gchar *maskspath = g_build_filename (dir, "masks", NULL);
+  g_autofree gchar *contents = NULL;
+  if (!g_file_get_contents (maskspath, &contents, NULL, NULL))
+    {
+      g_debug ("Snapshot %s not found", dir);
+      return FALSE;
+    }
+
+  for (guint i = 0; i <= repos->len; i++)
+    {
+      const char *name = i ? ((GStrv) g_ptr_array_index (repos, i - 1))[0] : "@system";
+      g_autofree gchar *path = snapshot_repo_path (dir, i);
+      Repo *repo = repo_create (pool, name);
+      g_ptr_array_add (loaded, repo);
+
+      if (!load_cached_repo (repo, path, NULL))
+        {
+          /* Broken, get it out of the way of a new one */
+          g_warning ("Could not load snapshot %s", path);
+          g_ptr_array_set_size (loaded, 0);
+          pool_freeallrepos (pool, 1);
+          remove_snapshot (dir);
+          return FALSE;
+        }
+    }
+
+  /* Each line is the index of a repo and the offset of a solvable in it */
+  g_auto(GStrv) lines = g_strsplit (contents, "\n", -1);
+  for (GStrv line = lines; *line; line++)
+    {
+      guint index, offset;
+      if (sscanf (*line, "%u %u", &index, &offset) != 2 || index >= loaded->len)
+        continue;
+      Repo *repo = g_ptr_array_index (loaded, index);
+      if (offset < (guint) repo->nsolvables)
+        queue_push2 (masks, SOLVER_SOLVABLE, repo->start + offset);
+    }
+
+  g_debug ("Loaded snapshot %s", dir);
+  return TRUE;
+}
+
+/**
+ * pool_snapshot_write:
+ * @dir: snapshot directory from pool_snapshot_dir()
+ * @loaded: the system repo followed by the loaded repos
+ * @masks: selection of masked packages
+ * @options: options, for the maximum age of snapshots
+ *
+ * Write all the repos of a fully loaded pool, with the file provides added,
+ * and the packages masked by modules to a snapshot. It's written to a
+ * temporary directory renamed in place at the end, so that concurrent
+ * processes never see a partial snapshot. Snapshots beyond the few most
+ * recently used ones are removed beforehand.
+ */
+void
+pool_snapshot_write (const char        *dir,
+                     GPtrArray         *loaded,
+                     Queue             *masks,
+                     const FusOptions  *options)
+{
+  snapshots_gc (dir, options->cache_max_age);
+
+  g_autofree gchar *parent = g_path_get_dirname (dir);
+  g_autofree gchar *tmpdir = g_strconcat (dir, ".XXXXXX", NULL);
+  if (g_mkdir_with_parents (parent, 0700) == -1 || !g_mkdtemp (tmpdir))
+    {
+      g_warning ("Could not create snapshot %s: %s", dir, g_strerror (errno));
+      return;
+    }
+
+  Pool *pool = ((Repo *) g_ptr_array_index (loaded, 0))->pool;
+  /* Solvables are identified by their position in their repo, as pruning
+   * may have left holes in the pool which are gone once it's loaded */
+  g_autofree Id *offsets = g_new0 (Id, pool->nsolvables);
+  g_autoptr(GHashTable) indexes = g_hash_table_new (g_direct_hash, NULL);
+  gboolean ok = TRUE;
+
+  for (guint i = 0; ok && i < loaded->len; i++)
+    {
+      Repo *repo = g_ptr_array_index (loaded, i);
+      Solvable *s;
+      Id p, offset = 0;
+      FOR_REPO_SOLVABLES (repo, p, s)
+        offsets[p] = offset++;
+      g_hash_table_insert (indexes, repo, GUINT_TO_POINTER (i));
+
+      g_autofree gchar *path = snapshot_repo_path (tmpdir, i);
+      g_autofree gchar *tmppath = NULL;
+      FILE *fp = cache_file_create (path, &tmppath);
+      if (!fp)
+        {
+          ok = FALSE;
+          break;
+        }
+      repo_write_filtered (repo, fp, snapshot_keyfilter, NULL, NULL);
+      ok = cache_file_commit (fp, tmppath, path, NULL);
+    }
+
+  g_auto(Queue) q;
+  queue_init (&q);
+  selection_solvables (pool, masks, &q);
+  g_autoptr(GString) contents = g_string_new (NULL);
+  for (int i = 0; i < q.count; i++)
+    {
+      Solvable *s = pool_id2solvable (pool, q.elements[i]);
+      gpointer index;
+      if (g_hash_table_lookup_extended (indexes, s->repo, NULL, &index))
+        g_string_append_printf (contents, "%u %d\n", GPOINTER_TO_UINT (index), offsets[q.elements[i]]);
+    }
+
+  /* The masks are written last, as they mark the snapshot as complete */
+  g_autofree gchar *maskspath = g_build_filename (tmpdir, "masks", NULL);
+  g_autofree gchar *tmppath = NULL;
+  FILE *fp = ok ? cache_file_create (maskspath, &tmppath) : NULL;
+  if (fp)
+    {
+      fputs (contents->str, fp);
+      ok = cache_file_commit (fp, tmppath, maskspath, NULL);
+    }
+  else
+    ok = FALSE;
+
+  /* A snapshot without masks is incomplete, and can't be used anyway */
+  g_autofree gchar *existing = g_build_filename (dir, "masks", NULL);
+  if (ok && !g_file_test (existing, G_FILE_TEST_EXISTS))
+    remove_snapshot (dir);
+
+  if (ok && g_rename (tmpdir, dir) == 0)
+    {
+      g_debug ("Wrote snapshot %s", dir);
+      return;
+    }
+
+  /* Either writing failed, or another process was faster */
+  remove_snapshot (tmpdir);
 }
-#endif /* FUS_TESTING */
 
 static void
 add_platform_module (const char *platform,
@@ -841,19 +3048,16 @@ add_platform_module (const char *platform,
   modulemd_module_stream_set_version (module, 0);
   modulemd_module_stream_set_context (module, "00000000");
   modulemd_module_stream_v2_set_arch ((ModulemdModuleStreamV2 *) module, arch);
-  add_module_solvables (system, module);
-
-  g_autoptr(ModulemdDefaultsV1) defaults = modulemd_defaults_v1_new ("platform");
-  modulemd_defaults_v1_set_default_stream (defaults, platform, NULL);
-  _repo_add_modulemd_defaults (system, (ModulemdDefaults *)defaults);
+  g_auto(Queue) defaults;
+  queue_init (&defaults);
+  queue_push (&defaults, add_module_solvables (system, NULL, module));
+  _repo_add_modulemd_defaults (system->pool, &defaults);
 }
 
 Repo *
 create_system_repo (Pool *pool, const char *platform, const char *arch)
 {
   Repo *system = repo_create (pool, "@system");
-  /* Required for adding defaults */
-  pool_createwhatprovides (pool);
   if (platform)
     add_platform_module (platform, arch, system);
   return system;
@@ -1,6 +1,15 @@
+#include "fus.h"
+#include "cache.h"
+#include "download.h"
+#include "mirror.h"
+
 #include <locale.h>
+#include <gio/gio.h>
 #include <glib.h>
+#include <glib/gstdio.h>
 #include <solv/testcase.h>
+#include <string.h>
+#include <utime.h>
 
 #define ARCH     "x86_64"
 #define PLATFORM "f29"
@@ -18,8 +27,6 @@ typedef struct _test_data {
   gchar *expected;
 } TestData;
 
-extern GPtrArray *fus_depsolve(const char *, const char *, const GStrv, const GStrv, const GStrv, GError **);
-
 static void
 test_broken_dep (TestData *td, gconstpointer data)
 {
@@ -32,7 +39,7 @@ test_broken_dep (TestData *td, gconstpointer data)
       g_autoptr(GPtrArray) result = NULL;
       g_test_expect_message (G_LOG_DOMAIN, G_LOG_LEVEL_WARNING,
                              "*Can't resolve all solvables*");
-      result = fus_depsolve (ARCH, PLATFORM, NULL, repos, td->solvables, &error);
+      result = fus_depsolve (ARCH, PLATFORM, NULL, repos, td->solvables, NULL, &error);
       g_assert (result != NULL);
       g_assert_no_error (error);
       g_ptr_array_add (result, NULL); /* Need by g_strjoinv below */
@@ -68,7 +75,7 @@ test_fail_invalid_solvable (void)
   g_autoptr(GPtrArray) result = NULL;
   g_test_expect_message (G_LOG_DOMAIN, G_LOG_LEVEL_WARNING,
                          "*Nothing matches 'invalid'*");
-  result = fus_depsolve (ARCH, PLATFORM, NULL, repos, solvables, &error);
+  result = fus_depsolve (ARCH, PLATFORM, NULL, repos, solvables, NULL, &error);
   g_assert (result == NULL);
   g_assert_cmpstr (error->message, ==, "No solvables matched");
   g_test_assert_expected_messages ();
@@ -82,7 +89,7 @@ test_fail_no_solvables (void)
 
   g_autoptr(GError) error = NULL;
   g_autoptr(GPtrArray) result = NULL;
-  result = fus_depsolve (ARCH, PLATFORM, NULL, repos, solvables, &error);
+  result = fus_depsolve (ARCH, PLATFORM, NULL, repos, solvables, NULL, &error);
   g_assert_error (error, G_OPTION_ERROR, G_OPTION_ERROR_FAILED);
   g_assert (result == NULL);
   g_assert_cmpstr (error->message, ==, "No solvables matched");
@@ -96,31 +103,635 @@ test_invalid_repo (void)
 
   g_autoptr(GError) error = NULL;
   g_autoptr(GPtrArray) result = NULL;
-  result = fus_depsolve (ARCH, PLATFORM, NULL, repos, solvables, &error);
+  result = fus_depsolve (ARCH, PLATFORM, NULL, repos, solvables, NULL, &error);
   g_assert (result == NULL);
   g_assert_error (error, G_OPTION_ERROR, G_OPTION_ERROR_FAILED);
   g_assert_cmpstr (error->message, ==,
                    "Could not open invalid/packages.repo: No such file or directory");
 }
 
+#define TEST_DATA_SIZE (256 * 1024)
+
+/*
+ * A minimal HTTP server standing in for a mirror. It serves the same data to
+ * a fixed number of connections, one request each, optionally after a delay
+ * or cutting the first response halfway through, and records the start of
+ * the range each request asked for, which it may also ignore.
+ *
+ * With a root dir, it serves the files below it instead, until it's stopped,
+ * and answers requests for a file with its current ETag with 304 Not
+ * Modified. The ranges asked for are logged, one "$start-$end" per line.
+ */
+typedef struct {
+  GSocket *listener;
+  GThread *thread;
+  guint16 port;
+  guchar *data;
+  guint requests;
+  guint delay_ms;
+  gboolean cut_first;
+  gboolean no_ranges;
+  goffset ranges[4];
+  const char *root;
+  gboolean stopping;
+  guint full;
+  guint not_modified;
+  GString *requested;
+} TestServer;
+
 static void
-test_run (TestData *td, gconstpointer data)
+socket_send_all (GSocket *conn, const void *buf, gsize len)
 {
-  GStrv repos = (char **)td->repos->pdata;
+  while (len)
+    {
+      gssize n = g_socket_send (conn, buf, len, NULL, NULL);
+      if (n <= 0)
+        return;
+      buf = (const guchar *) buf + n;
+      len -= n;
+    }
+}
 
-  if (g_test_subprocess ())
+static void
+test_server_send_file (TestServer *server, GSocket *conn, const char *request)
+{
+  /* "GET /$path HTTP/1.1" */
+  g_auto(GStrv) words = g_strsplit (request, " ", 3);
+  if (g_strv_length (words) < 3)
+    return;
+  g_autofree gchar *path = g_build_filename (server->root, words[1], NULL);
+  g_autofree gchar *contents = NULL;
+  gsize len;
+  if (!g_file_get_contents (path, &contents, &len, NULL))
     {
-      g_autoptr(GError) error = NULL;
-      g_autoptr(GPtrArray) result = NULL;
-      result = fus_depsolve (ARCH, PLATFORM, NULL, repos, td->solvables, &error);
+      const char *headers = "HTTP/1.1 404 Not Found\r\n"
+                            "Content-Length: 0\r\n"
+                            "Connection: close\r\n\r\n";
+      socket_send_all (conn, headers, strlen (headers));
+      return;
+    }
+
+  g_autofree gchar *hash = g_compute_checksum_for_data (G_CHECKSUM_SHA256, (guchar *) contents, len);
+  g_autofree gchar *etag = g_strdup_printf ("\"%s\"", hash);
+  g_autofree gchar *match = g_strdup_printf ("If-None-Match: %s\r\n", etag);
+  g_autofree gchar *headers = NULL;
+  if (strstr (request, match))
+    {
+      server->not_modified++;
+      headers = g_strdup_printf ("HTTP/1.1 304 Not Modified\r\n"
+                                 "ETag: %s\r\n"
+                                 "Connection: close\r\n\r\n",
+                                 etag);
+      socket_send_all (conn, headers, strlen (headers));
+      return;
+    }
+
+  const char *range = strstr (request, "Range: bytes=");
+  if (range)
+    {
+      gchar *end;
+      guint64 start = g_ascii_strtoull (range + strlen ("Range: bytes="), &end, 10);
+      guint64 last = g_ascii_strtoull (end + 1, NULL, 10);
+      g_string_append_printf (server->requested, "%" G_GUINT64_FORMAT "-%" G_GUINT64_FORMAT "\n",
+                              start, last);
+      last = MIN (last, len - 1);
+      headers = g_strdup_printf ("HTTP/1.1 206 Partial Content\r\n"
+                                 "Content-Length: %" G_GUINT64_FORMAT "\r\n"
+                                 "Content-Range: bytes %" G_GUINT64_FORMAT "-%" G_GUINT64_FORMAT "/%" G_GSIZE_FORMAT "\r\n"
+                                 "Connection: close\r\n\r\n",
+                                 last - start + 1, start, last, len);
+      socket_send_all (conn, headers, strlen (headers));
+      socket_send_all (conn, contents + start, last - start + 1);
+      return;
+    }
+
+  server->full++;
+  headers = g_strdup_printf ("HTTP/1.1 200 OK\r\n"
+                             "Content-Length: %" G_GSIZE_FORMAT "\r\n"
+                             "ETag: %s\r\n"
+                             "Connection: close\r\n\r\n",
+                             len, etag);
+  socket_send_all (conn, headers, strlen (headers));
+  socket_send_all (conn, contents, len);
+}
+
+static gpointer
+test_server_thread (gpointer user_data)
+{
+  TestServer *server = user_data;
+
+  for (guint i = 0; server->root || (i < server->requests && i < G_N_ELEMENTS (server->ranges)); i++)
+    {
+      g_autoptr(GSocket) conn = g_socket_accept (server->listener, NULL, NULL);
+      if (!conn || server->stopping)
+        break;
+
+      g_autoptr(GString) request = g_string_new (NULL);
+      while (!strstr (request->str, "\r\n\r\n"))
+        {
+          char buf[1024];
+          gssize len = g_socket_receive (conn, buf, sizeof (buf), NULL, NULL);
+          if (len <= 0)
+            break;
+          g_string_append_len (request, buf, len);
+        }
+
+      if (server->root)
+        {
+          test_server_send_file (server, conn, request->str);
+          g_socket_close (conn, NULL);
+          continue;
+        }
+
+      goffset start = 0;
+      const char *range = strstr (request->str, "Range: bytes=");
+      if (range)
+        start = g_ascii_strtoll (range + strlen ("Range: bytes="), NULL, 10);
+      server->ranges[i] = start;
+      if (server->no_ranges)
+        start = 0;
+
+      g_usleep (server->delay_ms * 1000);
+
+      g_autofree gchar *headers = NULL;
+      if (start > 0)
+        headers = g_strdup_printf ("HTTP/1.1 206 Partial Content\r\n"
+                                   "Content-Length: %" G_GOFFSET_FORMAT "\r\n"
+                                   "Content-Range: bytes %" G_GOFFSET_FORMAT "-%d/%d\r\n"
+                                   "Connection: close\r\n\r\n",
+                                   TEST_DATA_SIZE - start, start,
+                                   TEST_DATA_SIZE - 1, TEST_DATA_SIZE);
+      else
+        headers = g_strdup_printf ("HTTP/1.1 200 OK\r\n"
+                                   "Content-Length: %d\r\n"
+                                   "Connection: close\r\n\r\n",
+                                   TEST_DATA_SIZE);
+      socket_send_all (conn, headers, strlen (headers));
+
+      goffset end = i == 0 && server->cut_first ? TEST_DATA_SIZE / 2 : TEST_DATA_SIZE;
+      socket_send_all (conn, server->data + start, end - start);
+      g_socket_close (conn, NULL);
+    }
+
+  return NULL;
+}
+
+static GSocket *
+test_listen (guint16 *port)
+{
+  g_autoptr(GError) error = NULL;
+  GSocket *listener = g_socket_new (G_SOCKET_FAMILY_IPV4, G_SOCKET_TYPE_STREAM,
+                                    G_SOCKET_PROTOCOL_TCP, &error);
+  g_assert_no_error (error);
+  g_autoptr(GInetAddress) loopback = g_inet_address_new_loopback (G_SOCKET_FAMILY_IPV4);
+  g_autoptr(GSocketAddress) addr = g_inet_socket_address_new (loopback, 0);
+  g_socket_bind (listener, addr, TRUE, &error);
+  g_assert_no_error (error);
+  g_socket_listen (listener, &error);
+  g_assert_no_error (error);
+  g_autoptr(GSocketAddress) bound = g_socket_get_local_address (listener, &error);
+  g_assert_no_error (error);
+
+  *port = g_inet_socket_address_get_port (G_INET_SOCKET_ADDRESS (bound));
+  return listener;
+}
+
+static void
+test_server_start (TestServer *server, guint requests)
+{
+  server->data = g_malloc (TEST_DATA_SIZE);
+  for (int i = 0; i < TEST_DATA_SIZE; i++)
+    server->data[i] = i * 7 % 251;
+
+  server->requests = requests;
+  server->requested = g_string_new (NULL);
+  server->listener = test_listen (&server->port);
+  server->thread = g_thread_new ("server", test_server_thread, server);
+}
+
+static void
+test_server_stop (TestServer *server)
+{
+  /* Serving files goes on until a connection finds it stopping */
+  if (server->root)
+    {
+      server->stopping = TRUE;
+      g_autoptr(GSocketClient) client = g_socket_client_new ();
+      g_autoptr(GSocketConnection) conn =
+        g_socket_client_connect_to_host (client, "127.0.0.1", server->port, NULL, NULL);
+    }
+  g_thread_join (server->thread);
+  g_string_free (server->requested, TRUE);
+  g_object_unref (server->listener);
+  g_free (server->data);
+}
+
+static void
+test_download_resume (void)
+{
+  g_autoptr(GError) error = NULL;
+  TestServer server = { .cut_first = TRUE };
+  test_server_start (&server, 2);
+
+  Chksum *chk = solv_chksum_create (REPOKEY_TYPE_SHA256);
+  solv_chksum_add (chk, server.data, TEST_DATA_SIZE);
+  const unsigned char *chksum = solv_chksum_get (chk, NULL);
+
+  g_autofree gchar *url = g_strdup_printf ("http://127.0.0.1:%u/primary.xml.gz", server.port);
+  g_autofree gchar *tmpdir = g_dir_make_tmp ("fus-XXXXXX", &error);
+  g_assert_no_error (error);
+  g_autofree gchar *path = g_build_filename (tmpdir, "primary.xml.gz", NULL);
+  g_autofree gchar *partpath = g_strconcat (path, ".part", NULL);
+
+  g_autoptr(SoupSession) session = soup_session_new ();
+  gboolean ret = download_to_path (session, url, path, REPOKEY_TYPE_SHA256, chksum, &error);
+
+  g_assert_no_error (error);
+  g_assert_true (ret);
+  /* The second request only asked for what the first one did not deliver */
+  g_assert_cmpint (server.ranges[0], ==, 0);
+  g_assert_cmpint (server.ranges[1], ==, TEST_DATA_SIZE / 2);
+  g_assert_false (g_file_test (partpath, G_FILE_TEST_EXISTS));
+
+  g_autofree gchar *contents = NULL;
+  gsize len;
+  g_file_get_contents (path, &contents, &len, &error);
+  g_assert_no_error (error);
+  g_assert_cmpuint (len, ==, TEST_DATA_SIZE);
+  g_assert_true (memcmp (contents, server.data, len) == 0);
+
+  test_server_stop (&server);
+  solv_chksum_free (chk, NULL);
+  g_unlink (path);
+  g_rmdir (tmpdir);
+}
+
+/* Read everything from a stream of a download of the test server's data */
+static void
+assert_stream_data (TestServer *server,
+                    Download   *dl)
+{
+  g_autoptr(GError) error = NULL;
+  g_autoptr(SoupSession) session = soup_session_new ();
+  DownloadStream *stream = download_stream_open (session, dl, &error);
+  g_assert_no_error (error);
+
+  g_autofree guchar *read = g_malloc (TEST_DATA_SIZE + 1);
+  gsize len = fread (read, 1, TEST_DATA_SIZE + 1, download_stream_get_fp (stream));
+  gboolean ret = download_stream_close (stream, &error);
+  g_assert_no_error (error);
+  g_assert_true (ret);
+  g_assert_cmpuint (len, ==, TEST_DATA_SIZE);
+  g_assert_true (memcmp (read, server->data, len) == 0);
+
+  g_autofree gchar *contents = NULL;
+  g_file_get_contents (dl->path, &contents, &len, &error);
+  g_assert_no_error (error);
+  g_assert_cmpuint (len, ==, TEST_DATA_SIZE);
+  g_assert_true (memcmp (contents, server->data, len) == 0);
+  g_unlink (dl->path);
+}
+
+static void
+test_download_stream_resume (void)
+{
+  g_autoptr(GError) error = NULL;
+  g_autofree gchar *tmpdir = g_dir_make_tmp ("fus-XXXXXX", &error);
+  g_assert_no_error (error);
+  g_autofree gchar *path = g_build_filename (tmpdir, "primary.xml", NULL);
+  g_autofree gchar *partpath = g_strconcat (path, ".part", NULL);
+  TestServer servers[] = {
+    { .cut_first = TRUE },
+    { .cut_first = TRUE, .no_ranges = TRUE },
+    { 0 },
+  };
+
+  for (guint i = 0; i < G_N_ELEMENTS (servers); i++)
+    {
+      TestServer *server = &servers[i];
+      test_server_start (server, i < 2 ? 2 : 1);
+
+      Chksum *chk = solv_chksum_create (REPOKEY_TYPE_SHA256);
+      solv_chksum_add (chk, server->data, TEST_DATA_SIZE);
+      g_autofree gchar *url = g_strdup_printf ("http://127.0.0.1:%u/primary.xml", server->port);
+      g_autoptr(Download) dl = download_new (url, path);
+      download_set_checksum (dl, REPOKEY_TYPE_SHA256, solv_chksum_get (chk, NULL));
+
+      /* Left by an interrupted run */
+      if (i == 2)
+        {
+          g_file_set_contents (partpath, (gchar *) server->data, TEST_DATA_SIZE / 2, &error);
+          g_assert_no_error (error);
+        }
+
+      /* Whether the server sends only the missing part or everything again,
+       * the reader gets each byte once */
+      assert_stream_data (server, dl);
+      g_assert_cmpint (server->ranges[0], ==, i < 2 ? 0 : TEST_DATA_SIZE / 2);
+      if (i < 2)
+        g_assert_cmpint (server->ranges[1], ==, TEST_DATA_SIZE / 2);
+      g_assert_false (g_file_test (partpath, G_FILE_TEST_EXISTS));
+
+      test_server_stop (server);
+      solv_chksum_free (chk, NULL);
+    }
+
+  g_rmdir (tmpdir);
+}
+
+static void
+zck_append_compint (GByteArray *data, guint64 val)
+{
+  for (; val >= 0x80; val >>= 7)
+    {
+      guchar c = val & 0x7f;
+      g_byte_array_append (data, &c, 1);
+    }
+  guchar c = val | 0x80;
+  g_byte_array_append (data, &c, 1);
+}
+
+/*
+ * Build an uncompressed zchunk file made of chunks of #ZCK_TEST_CHUNK_SIZE
+ * bytes, each filled with one of the characters of @fills. Chunk checksums
+ * are truncated SHA-512, which is all zck_download() looks at.
+ */
+#define ZCK_TEST_CHUNK_SIZE 8000
+
+static GByteArray *
+zck_build (const char *fills,
+           guint64    *hdrlen)
+{
+  g_autoptr(GByteArray) index = g_byte_array_new ();
+  zck_append_compint (index, 3);
+  zck_append_compint (index, strlen (fills));
+  for (const char *fill = fills; *fill; fill++)
+    {
+      g_autofree gchar *chunk = g_strnfill (ZCK_TEST_CHUNK_SIZE, *fill);
+      g_autoptr(GChecksum) chk = g_checksum_new (G_CHECKSUM_SHA512);
+      g_checksum_update (chk, (guchar *) chunk, ZCK_TEST_CHUNK_SIZE);
+      guint8 digest[64];
+      gsize digestlen = sizeof (digest);
+      g_checksum_get_digest (chk, digest, &digestlen);
+      g_byte_array_append (index, digest, 16);
+      zck_append_compint (index, ZCK_TEST_CHUNK_SIZE);
+      zck_append_compint (index, ZCK_TEST_CHUNK_SIZE);
+    }
+
+  /* Preface, with no flags and no compression, then the index */
+  static const guchar nochksum[32] = { 0 };
+  g_autoptr(GByteArray) header = g_byte_array_new ();
+  g_byte_array_append (header, nochksum, sizeof (nochksum));
+  zck_append_compint (header, 0);
+  zck_append_compint (header, 0);
+  zck_append_compint (header, index->len);
+  g_byte_array_append (header, index->data, index->len);
+
+  /* Lead, with SHA-256 header checksums */
+  GByteArray *data = g_byte_array_new ();
+  g_byte_array_append (data, (const guchar *) "\0ZCK1", 5);
+  zck_append_compint (data, 1);
+  zck_append_compint (data, header->len);
+  g_byte_array_append (data, nochksum, sizeof (nochksum));
+  g_byte_array_append (data, header->data, header->len);
+  *hdrlen = data->len;
+
+  for (const char *fill = fills; *fill; fill++)
+    {
+      g_autofree gchar *chunk = g_strnfill (ZCK_TEST_CHUNK_SIZE, *fill);
+      g_byte_array_append (data, (guchar *) chunk, ZCK_TEST_CHUNK_SIZE);
+    }
+
+  return data;
+}
+
+static void
+test_zck_download (void)
+{
+  g_autoptr(GError) error = NULL;
+  g_autofree gchar *tmpdir = g_dir_make_tmp ("fus-XXXXXX", &error);
+  g_assert_no_error (error);
+
+  /* Only the chunk of 'b's is not in the seed */
+  guint64 hdrlen, seedhdrlen;
+  g_autoptr(GByteArray) data = zck_build ("abc", &hdrlen);
+  g_autoptr(GByteArray) seeddata = zck_build ("axc", &seedhdrlen);
+
+  g_autofree gchar *srvdir = g_build_filename (tmpdir, "srv", NULL);
+  g_assert_cmpint (g_mkdir (srvdir, 0700), ==, 0);
+  g_autofree gchar *srvpath = g_build_filename (srvdir, "primary.xml.zck", NULL);
+  g_file_set_contents (srvpath, (gchar *) data->data, data->len, &error);
+  g_assert_no_error (error);
+  g_autofree gchar *seed = g_build_filename (tmpdir, "old-primary.xml.zck", NULL);
+  g_file_set_contents (seed, (gchar *) seeddata->data, seeddata->len, &error);
+  g_assert_no_error (error);
+
+  TestServer server = { .root = srvdir };
+  test_server_start (&server, 0);
+  g_autofree gchar *url = g_strdup_printf ("http://127.0.0.1:%u/primary.xml.zck", server.port);
+  g_autofree gchar *path = g_build_filename (tmpdir, "primary.xml.zck", NULL);
+
+  Chksum *chk = solv_chksum_create (REPOKEY_TYPE_SHA256);
+  solv_chksum_add (chk, data->data, data->len);
+  g_autoptr(SoupSession) session = soup_session_new ();
+  gboolean ret = zck_download (session, url, path, seed, REPOKEY_TYPE_SHA256,
+                               solv_chksum_get (chk, NULL), &error);
+  g_assert_no_error (error);
+  g_assert_true (ret);
+
+  /* The header, then only the missing chunk */
+  g_autofree gchar *requested = g_strdup_printf ("0-%d\n"
+                                                 "%" G_GUINT64_FORMAT "-%" G_GUINT64_FORMAT "\n",
+                                                 16 * 1024 - 1,
+                                                 hdrlen + ZCK_TEST_CHUNK_SIZE,
+                                                 hdrlen + 2 * ZCK_TEST_CHUNK_SIZE - 1);
+  g_assert_cmpstr (server.requested->str, ==, requested);
+
+  g_autofree gchar *contents = NULL;
+  gsize len;
+  g_file_get_contents (path, &contents, &len, &error);
+  g_assert_no_error (error);
+  g_assert_cmpuint (len, ==, data->len);
+  g_assert_true (memcmp (contents, data->data, len) == 0);
+  g_unlink (path);
+
+  /* The same, after falling back from a mirror which doesn't have the file */
+  g_autofree gchar *missing = g_strdup_printf ("http://127.0.0.1:%u/missing", server.port);
+  g_autofree gchar *base = g_strdup_printf ("http://127.0.0.1:%u", server.port);
+  g_autoptr(GPtrArray) mirrors = g_ptr_array_new ();
+  g_ptr_array_add (mirrors, missing);
+  g_ptr_array_add (mirrors, base);
+  g_autofree gchar *missingurl = g_strconcat (missing, "/primary.xml.zck", NULL);
+  g_autoptr(Download) dl = download_new (missingurl, path);
+  download_set_checksum (dl, REPOKEY_TYPE_SHA256, solv_chksum_get (chk, NULL));
+  download_set_mirrors (dl, mirrors, "primary.xml.zck");
+  g_string_truncate (server.requested, 0);
+  ret = download_zck (session, dl, seed, &error);
+  g_assert_no_error (error);
+  g_assert_true (ret);
+  g_assert_cmpstr (dl->url, ==, url);
+  g_assert_cmpstr (server.requested->str, ==, requested);
+  test_server_stop (&server);
+
+  g_clear_pointer (&contents, g_free);
+  g_file_get_contents (path, &contents, &len, &error);
+  g_assert_no_error (error);
+  g_assert_cmpuint (len, ==, data->len);
+  g_assert_true (memcmp (contents, data->data, len) == 0);
+
+  /* A header claiming to be huge is rejected before anything is allocated
+   * for it */
+  g_byte_array_set_size (seeddata, 5);
+  zck_append_compint (seeddata, 1);
+  zck_append_compint (seeddata, G_MAXUINT64 - 8);
+  g_file_set_contents (seed, (gchar *) seeddata->data, seeddata->len, &error);
+  g_assert_no_error (error);
+  ret = zck_download (session, url, path, seed, REPOKEY_TYPE_SHA256,
+                      solv_chksum_get (chk, NULL), &error);
+  g_assert_false (ret);
+  g_assert_error (error, G_OPTION_ERROR, G_OPTION_ERROR_FAILED);
+
+  solv_chksum_free (chk, NULL);
+  g_unlink (path);
+  g_unlink (seed);
+  g_unlink (srvpath);
+  g_rmdir (srvdir);
+  g_rmdir (tmpdir);
+}
+
+static void
+test_mirrors_parse (void)
+{
+  g_autoptr(GError) error = NULL;
+  const char *metalink =
+    "<?xml version=\"1.0\" encoding=\"utf-8\"?>\n"
+    "<metalink version=\"3.0\" xmlns=\"http://www.metalinker.org/\">\n"
+    " <files><file name=\"repomd.xml\"><resources>\n"
+    "  <url protocol=\"rsync\">rsync://a.example.com/f29/repodata/repomd.xml</url>\n"
+    "  <url protocol=\"https\">https://b.example.com/f29/repodata/repomd.xml</url>\n"
+    "  <url protocol=\"http\">http://c.example.com/f29/repodata/repomd.xml</url>\n"
+    " </resources></file></files>\n"
+    "</metalink>\n";
+
+  g_autoptr(GPtrArray) mirrors = mirrors_parse ("metalink=https://mirrors.example.com/metalink",
+                                                metalink, strlen (metalink), &error);
+  g_assert_no_error (error);
+  g_assert_cmpuint (mirrors->len, ==, 2);
+  g_assert_cmpstr (g_ptr_array_index (mirrors, 0), ==, "https://b.example.com/f29");
+  g_assert_cmpstr (g_ptr_array_index (mirrors, 1), ==, "http://c.example.com/f29");
+
+  const char *mirrorlist =
+    "# repo = f29 arch = x86_64\n"
+    "http://a.example.com/f29/\n"
+    "ftp://b.example.com/f29/\n"
+    "\n";
+  g_autoptr(GPtrArray) listed = mirrors_parse ("mirrorlist=https://mirrors.example.com/mirrorlist",
+                                               mirrorlist, strlen (mirrorlist), &error);
+  g_assert_no_error (error);
+  g_assert_cmpuint (listed->len, ==, 1);
+  g_assert_cmpstr (g_ptr_array_index (listed, 0), ==, "http://a.example.com/f29");
+}
+
+static void
+test_mirrors_rank (void)
+{
+  g_autoptr(GError) error = NULL;
+  TestServer slow = { .delay_ms = 300 };
+  TestServer fast = { 0 };
+  test_server_start (&slow, 1);
+  test_server_start (&fast, 1);
+
+  /* Nothing listens on this one once the socket is closed */
+  guint16 deadport;
+  g_object_unref (test_listen (&deadport));
+
+  g_autoptr(GPtrArray) mirrors = g_ptr_array_new_with_free_func (g_free);
+  g_ptr_array_add (mirrors, g_strdup_printf ("http://127.0.0.1:%u/slow", slow.port));
+  g_ptr_array_add (mirrors, g_strdup_printf ("http://127.0.0.1:%u/dead", deadport));
+  g_ptr_array_add (mirrors, g_strdup_printf ("http://127.0.0.1:%u/fast", fast.port));
+
+  g_autofree gchar *tmpdir = g_dir_make_tmp ("fus-XXXXXX", &error);
+  g_assert_no_error (error);
+  g_autoptr(SoupSession) session = soup_session_new ();
+  mirrors_rank (session, mirrors, DEFAULT_PARALLEL_DOWNLOADS, tmpdir);
+  test_server_stop (&slow);
+  test_server_stop (&fast);
+
+  g_assert_true (g_str_has_suffix (g_ptr_array_index (mirrors, 0), "/fast"));
+  g_assert_true (g_str_has_suffix (g_ptr_array_index (mirrors, 1), "/slow"));
+  g_assert_true (g_str_has_suffix (g_ptr_array_index (mirrors, 2), "/dead"));
+
+  g_rmdir (tmpdir);
+}
+
+static gboolean
+test_cache_keep (const char *relpath, gpointer user_data)
+{
+  return g_str_has_prefix (relpath, "keep");
+}
+
+static void
+test_cache_gc (void)
+{
+  g_autoptr(GError) error = NULL;
+  g_autofree gchar *tmpdir = g_dir_make_tmp ("fus-XXXXXX", &error);
+  g_assert_no_error (error);
+
+  /* Each file is 1 KiB, used the given number of days ago */
+  static const struct { const char *name; int age; } files[] = {
+    { "keep", 100 }, { "ancient", 100 }, { "old", 20 }, { "older", 30 }, { "new", 0 },
+  };
+  gint64 now = g_get_real_time () / G_USEC_PER_SEC;
+  for (unsigned int i = 0; i < G_N_ELEMENTS (files); i++)
+    {
+      g_autofree gchar *path = g_build_filename (tmpdir, files[i].name, NULL);
+      g_autofree gchar *contents = g_strnfill (1024, 'x');
+      g_file_set_contents (path, contents, 1024, &error);
       g_assert_no_error (error);
-      g_assert (result != NULL);
+      struct utimbuf times = { now - files[i].age * 86400, now - files[i].age * 86400 };
+      g_assert_cmpint (g_utime (path, &times), ==, 0);
+    }
 
-      g_ptr_array_add (result, NULL); /* Need by g_strjoinv below */
-      g_autofree char *strres = g_strjoinv ("\n", (char **)result->pdata);
-      g_autofree char *diff = testcase_resultdiff (td->expected, strres);
-      g_assert_cmpstr (diff, ==, NULL);
+  /* The ancient file expires, then the oldest one goes to fit in 3 KiB */
+  cache_gc (tmpdir, test_cache_keep, NULL, 3 * 1024, 50 * 86400);
+
+  for (unsigned int i = 0; i < G_N_ELEMENTS (files); i++)
+    {
+      g_autofree gchar *path = g_build_filename (tmpdir, files[i].name, NULL);
+      gboolean removed = g_strcmp0 (files[i].name, "ancient") == 0 ||
+                         g_strcmp0 (files[i].name, "older") == 0;
+      g_assert_cmpint (g_file_test (path, G_FILE_TEST_EXISTS), !=, removed);
+      g_unlink (path);
+    }
+
+  g_rmdir (tmpdir);
+}
+
+static void
+assert_depsolve (GStrv              exclude,
+                 GStrv              repos,
+                 GStrv              solvables,
+                 const FusOptions  *options,
+                 const char        *expected)
+{
+  g_autoptr(GError) error = NULL;
+  g_autoptr(GPtrArray) result = fus_depsolve (ARCH, PLATFORM, exclude, repos, solvables,
+                                              options, &error);
+  g_assert_no_error (error);
+  g_assert (result != NULL);
+
+  g_ptr_array_add (result, NULL); /* Need by g_strjoinv below */
+  g_autofree char *strres = g_strjoinv ("\n", (char **)result->pdata);
+  g_autofree char *diff = testcase_resultdiff (expected, strres);
+  g_assert_cmpstr (diff, ==, NULL);
+}
 
+static void
+test_run (TestData *td, gconstpointer data)
+{
+  if (g_test_subprocess ())
+    {
+      assert_depsolve (NULL, (GStrv) td->repos->pdata, td->solvables, NULL, td->expected);
       return;
     }
 
@@ -131,6 +742,359 @@ test_run (TestData *td, gconstpointer data)
   g_test_trap_assert_stderr_unmatched ("*Can't resolve all solvables*");
 }
 
+static void
+test_prune (TestData *td, gconstpointer data)
+{
+  if (g_test_subprocess ())
+    {
+      FusOptions options = { .parallel_downloads = DEFAULT_PARALLEL_DOWNLOADS, .prune = TRUE };
+      assert_depsolve (td->excluded, (GStrv) td->repos->pdata, td->solvables, &options, td->expected);
+      return;
+    }
+
+  g_test_trap_subprocess (NULL, 0, 0);
+  g_test_trap_assert_passed ();
+  g_test_trap_assert_stderr_unmatched ("*Nothing matches*");
+  g_test_trap_assert_stderr_unmatched ("*Can't resolve all solvables*");
+}
+
+/* Copy the files of a test repo, so that they can be changed */
+static gchar *
+copy_test_repo (const char *name,
+                const char *const *files)
+{
+  g_autoptr(GError) error = NULL;
+  g_autofree gchar *tmpdir = g_dir_make_tmp ("fus-XXXXXX", &error);
+  g_assert_no_error (error);
+
+  for (const char *const *file = files; *file; file++)
+    {
+      g_autofree gchar *contents = NULL;
+      gsize len;
+      g_file_get_contents (g_test_get_filename (G_TEST_DIST, name, *file, NULL),
+                           &contents, &len, &error);
+      g_assert_no_error (error);
+
+      g_autofree gchar *path = g_build_filename (tmpdir, *file, NULL);
+      g_autofree gchar *dir = g_path_get_dirname (path);
+      g_assert_cmpint (g_mkdir_with_parents (dir, 0700), ==, 0);
+      g_file_set_contents (path, contents, len, &error);
+      g_assert_no_error (error);
+    }
+
+  return g_steal_pointer (&tmpdir);
+}
+
+static void
+remove_tree (const char *path)
+{
+  g_autoptr(GDir) dir = g_dir_open (path, 0, NULL);
+  const char *name;
+  while (dir && (name = g_dir_read_name (dir)))
+    {
+      g_autofree gchar *child = g_build_filename (path, name, NULL);
+      if (g_file_test (child, G_FILE_TEST_IS_DIR) && !g_file_test (child, G_FILE_TEST_IS_SYMLINK))
+        remove_tree (child);
+      else
+        g_unlink (child);
+    }
+  g_rmdir (path);
+}
+
+/* Start with an empty cache, for tests that name their repos as the expected
+ * results do */
+static void
+reset_cache (void)
+{
+  g_autofree gchar *cachedir = g_build_filename (g_get_user_cache_dir (), "fus", NULL);
+  remove_tree (cachedir);
+}
+
+static gchar *
+read_expected (const char *name)
+{
+  g_autoptr(GError) error = NULL;
+  gchar *expected = NULL;
+  g_file_get_contents (g_test_get_filename (G_TEST_DIST, name, "expected", NULL),
+                       &expected, NULL, &error);
+  g_assert_no_error (error);
+  return expected;
+}
+
+static void
+test_prune_warm_cache (void)
+{
+  reset_cache ();
+
+  static const char *const files[] = {
+    "repodata/repomd.xml", "repodata/primary.xml", "repodata/filelists.xml", NULL
+  };
+  g_autofree gchar *repodir = copy_test_repo ("prune-warm-cache", files);
+  g_autofree gchar *repo = g_strconcat ("repo,repo,", repodir, NULL);
+  gchar *repos[] = { repo, NULL };
+  gchar *solvables[] = { "app", NULL };
+  FusOptions options = { .parallel_downloads = DEFAULT_PARALLEL_DOWNLOADS, .prune = TRUE };
+  g_autofree gchar *expected = read_expected ("prune-warm-cache");
+
+  /* The first run fills the cache. In the second one the file provides can
+   * only come from the cached filelists, which have to be loaded into a
+   * repo with the aarch64 package in the middle of it */
+  for (int run = 0; run < 2; run++)
+    {
+      assert_depsolve (NULL, repos, solvables, &options, expected);
+
+      g_autofree gchar *filelists = g_build_filename (repodir, "repodata", "filelists.xml", NULL);
+      g_unlink (filelists);
+    }
+
+  remove_tree (repodir);
+}
+
+static void
+test_cacheonly (void)
+{
+  reset_cache ();
+
+  TestServer server = { .root = g_test_get_filename (G_TEST_DIST, "prune-warm-cache", NULL) };
+  test_server_start (&server, 0);
+
+  g_autofree gchar *repo = g_strdup_printf ("repo,repo,http://127.0.0.1:%u", server.port);
+  gchar *repos[] = { repo, NULL };
+  gchar *solvables[] = { "app", NULL };
+  FusOptions options = { .parallel_downloads = DEFAULT_PARALLEL_DOWNLOADS };
+  g_autofree gchar *expected = read_expected ("prune-warm-cache");
+
+  /* Everything is downloaded */
+  assert_depsolve (NULL, repos, solvables, &options, expected);
+  g_assert_cmpuint (server.full, >, 1);
+  g_assert_cmpuint (server.not_modified, ==, 0);
+
+  /* Only repomd.xml is asked for again, and it didn't change */
+  guint full = server.full;
+  assert_depsolve (NULL, repos, solvables, &options, expected);
+  g_assert_cmpuint (server.full, ==, full);
+  g_assert_cmpuint (server.not_modified, ==, 1);
+
+  /* What was kept in the cache is enough without the server */
+  test_server_stop (&server);
+  options.cacheonly = TRUE;
+  assert_depsolve (NULL, repos, solvables, &options, expected);
+}
+
+/* Path of a file in the cache of @repo, named after the checksum of @path */
+static gchar *
+cache_file_for (const char *repo,
+                const char *path,
+                const char *suffix)
+{
+  g_autoptr(GError) error = NULL;
+  g_autofree gchar *contents = NULL;
+  gsize len;
+  g_file_get_contents (path, &contents, &len, &error);
+  g_assert_no_error (error);
+  g_autofree gchar *chksum = g_compute_checksum_for_data (G_CHECKSUM_SHA256, (guchar *) contents, len);
+  g_autofree gchar *name = g_strconcat (chksum, suffix, NULL);
+  return g_build_filename (g_get_user_cache_dir (), "fus", repo, name, NULL);
+}
+
+static guint64
+file_inode (const char *path)
+{
+  GStatBuf st;
+  g_assert_cmpint (g_stat (path, &st), ==, 0);
+  return st.st_ino;
+}
+
+static void
+test_modular_cache (void)
+{
+  reset_cache ();
+
+  const char *yamlpath = g_test_get_filename (G_TEST_DIST, "snapshot", "modules.yaml", NULL);
+  g_autofree gchar *repo = g_strconcat ("repo,repo,",
+                                        g_test_get_filename (G_TEST_DIST, "snapshot", NULL),
+                                        NULL);
+  g_autofree gchar *yaml = g_strconcat ("yaml,modular,", yamlpath, NULL);
+  gchar *repos[] = { repo, yaml, NULL };
+  gchar *solvables[] = { "app", NULL };
+  FusOptions options = { .parallel_downloads = DEFAULT_PARALLEL_DOWNLOADS };
+  g_autofree gchar *expected = read_expected ("snapshot");
+
+  assert_depsolve (NULL, repos, solvables, &options, expected);
+  g_autofree gchar *cachefn = cache_file_for ("yaml", yamlpath, "-v2.solv");
+  guint64 inode = file_inode (cachefn);
+
+  /* Loaded from the cache, which is not written again */
+  assert_depsolve (NULL, repos, solvables, &options, expected);
+  g_assert_cmpuint (file_inode (cachefn), ==, inode);
+}
+
+/* Path of the overlay of the artifacts in @repodir of the modules in @yamlpath */
+static gchar *
+overlay_file_for (const char *yamlpath,
+                  const char *repodir)
+{
+  g_autofree gchar *yamlcache = cache_file_for ("yaml", yamlpath, "");
+  g_autofree gchar *repomd = g_build_filename (repodir, "repodata", "repomd.xml", NULL);
+  g_autofree gchar *repomdcache = cache_file_for ("repo", repomd, "");
+  g_autofree gchar *repochksum = g_path_get_basename (repomdcache);
+  return g_strconcat (yamlcache, "-overlay-repo-", repochksum, NULL);
+}
+
+static void
+test_modular_overlay (void)
+{
+  reset_cache ();
+
+  static const char *const files[] = {
+    "repodata/repomd.xml", "repodata/primary.xml", "repodata/filelists.xml", NULL
+  };
+  g_autofree gchar *repodir = copy_test_repo ("snapshot", files);
+  const char *yamlpath = g_test_get_filename (G_TEST_DIST, "snapshot", "modules.yaml", NULL);
+  g_autofree gchar *repo = g_strconcat ("repo,repo,", repodir, NULL);
+  g_autofree gchar *yaml = g_strconcat ("yaml,modular,", yamlpath, NULL);
+  gchar *repos[] = { repo, yaml, NULL };
+  gchar *solvables[] = { "app", NULL };
+  FusOptions options = { .parallel_downloads = DEFAULT_PARALLEL_DOWNLOADS };
+  g_autofree gchar *expected = read_expected ("snapshot");
+
+  /* The artifacts of the modules found in the repo are written out */
+  assert_depsolve (NULL, repos, solvables, &options, expected);
+  g_autofree gchar *overlay = overlay_file_for (yamlpath, repodir);
+  guint64 inode = file_inode (overlay);
+
+  /* and loaded back, together with the cached repos */
+  assert_depsolve (NULL, repos, solvables, &options, expected);
+  g_assert_cmpuint (file_inode (overlay), ==, inode);
+
+  /* New metadata of the repo replaces the overlay for the old one */
+  g_autofree gchar *repomd = g_build_filename (repodir, "repodata", "repomd.xml", NULL);
+  g_autofree gchar *contents = NULL;
+  g_autoptr(GError) error = NULL;
+  g_file_get_contents (repomd, &contents, NULL, &error);
+  g_assert_no_error (error);
+  g_autofree gchar *changed = g_strconcat (contents, "\n", NULL);
+  g_file_set_contents (repomd, changed, -1, &error);
+  g_assert_no_error (error);
+
+  assert_depsolve (NULL, repos, solvables, &options, expected);
+  g_autofree gchar *newoverlay = overlay_file_for (yamlpath, repodir);
+  g_assert_true (g_file_test (newoverlay, G_FILE_TEST_IS_REGULAR));
+  g_assert_false (g_file_test (overlay, G_FILE_TEST_EXISTS));
+
+  remove_tree (repodir);
+}
+
+static void
+test_snapshot (void)
+{
+  reset_cache ();
+
+  static const char *const files[] = {
+    "repodata/repomd.xml", "repodata/primary.xml", "repodata/filelists.xml", NULL
+  };
+  g_autofree gchar *repodir = copy_test_repo ("snapshot", files);
+  g_autofree gchar *repo = g_strconcat ("repo,repo,", repodir, NULL);
+  g_autofree gchar *yaml = g_strconcat ("yaml,modular,",
+                                        g_test_get_filename (G_TEST_DIST, "snapshot",
+                                                             "modules.yaml", NULL),
+                                        NULL);
+  gchar *repos[] = { repo, yaml, NULL };
+  gchar *solvables[] = { "app", NULL };
+  FusOptions options = { .parallel_downloads = DEFAULT_PARALLEL_DOWNLOADS };
+  g_autofree gchar *expected = read_expected ("snapshot");
+
+  /* Without a snapshot, and then writing one */
+  assert_depsolve (NULL, repos, solvables, &options, expected);
+  options.snapshot = TRUE;
+  assert_depsolve (NULL, repos, solvables, &options, expected);
+
+  /* Only the snapshot is left to load the repo from */
+  static const char *const removed[] = { "primary.xml", "filelists.xml", NULL };
+  for (const char *const *file = removed; *file; file++)
+    {
+      g_autofree gchar *path = g_build_filename (repodir, "repodata", *file, NULL);
+      g_unlink (path);
+    }
+  g_autofree gchar *cachedir = g_build_filename (g_get_user_cache_dir (), "fus", "repo", NULL);
+  remove_tree (cachedir);
+
+  assert_depsolve (NULL, repos, solvables, &options, expected);
+
+  remove_tree (repodir);
+}
+
+static guint
+count_snapshots (void)
+{
+  g_autofree gchar *parent = g_build_filename (g_get_user_cache_dir (), "fus", "@snapshots", NULL);
+  g_autoptr(GDir) dir = g_dir_open (parent, 0, NULL);
+  guint count = 0;
+  while (dir && g_dir_read_name (dir))
+    count++;
+  return count;
+}
+
+static void
+test_snapshot_gc (void)
+{
+  reset_cache ();
+
+  static const char *const files[] = {
+    "repodata/repomd.xml", "repodata/primary.xml", "repodata/filelists.xml", NULL
+  };
+  g_autofree gchar *repodir = copy_test_repo ("snapshot", files);
+  g_autofree gchar *repo = g_strconcat ("repo,repo,", repodir, NULL);
+  gchar *repos[] = { repo, NULL };
+  gchar *solvables[] = { "app", NULL };
+  FusOptions options = { .parallel_downloads = DEFAULT_PARALLEL_DOWNLOADS, .snapshot = TRUE };
+  g_autofree gchar *repomd = g_build_filename (repodir, "repodata", "repomd.xml", NULL);
+
+  /* Each change of the metadata supersedes the last snapshot, of which only
+   * the three most recently used ones are kept */
+  for (guint run = 1; run <= 5; run++)
+    {
+      g_autoptr(GError) error = NULL;
+      g_autoptr(GPtrArray) result = fus_depsolve (ARCH, PLATFORM, NULL, repos, solvables,
+                                                  &options, &error);
+      g_assert_no_error (error);
+      g_assert (result != NULL);
+      g_assert_cmpuint (count_snapshots (), ==, MIN (run, 3));
+
+      g_autofree gchar *contents = NULL;
+      g_file_get_contents (repomd, &contents, NULL, &error);
+      g_assert_no_error (error);
+      g_autofree gchar *changed = g_strconcat (contents, "\n", NULL);
+      g_file_set_contents (repomd, changed, -1, &error);
+      g_assert_no_error (error);
+    }
+
+  remove_tree (repodir);
+}
+
+static void
+test_modules_first (TestData *td, gconstpointer data)
+{
+  /* Move the modules in front of the packages they list as artifacts */
+  GPtrArray *repos = td->repos;
+  gpointer yaml = g_ptr_array_index (repos, repos->len - 2);
+  memmove (repos->pdata + 1, repos->pdata, (repos->len - 2) * sizeof (gpointer));
+  g_ptr_array_index (repos, 0) = yaml;
+
+  test_run (td, data);
+}
+
+static void
+test_small_chunks (TestData *td, gconstpointer data)
+{
+  /* Each chunk only fits a couple of documents, so the versions of a
+   * stream are parsed apart, in parallel */
+  gsize chunk_size = modulemd_chunk_size;
+  modulemd_chunk_size = 512;
+  test_run (td, data);
+  modulemd_chunk_size = chunk_size;
+}
+
 static void
 test_order (TestData *td, gconstpointer data)
 {
@@ -227,12 +1191,27 @@ test_setup (TestData *tdata, gconstpointer data)
       g_ptr_array_add (tdata->repos, g_strdup_printf ("repo-0,lookaside,%s", lookaside_path));
       g_debug (" lookaside: %s", lookaside_path);
     }
+  /* Provides-only lookaside repos are loaded from rpm-md metadata */
+  g_autofree char *provides_path = g_build_filename (testpath, "lookaside", NULL);
+  if (g_file_test (provides_path, G_FILE_TEST_IS_DIR))
+    {
+      g_ptr_array_add (tdata->repos, g_strdup_printf ("lookaside,%s,%s",
+                                                      LOOKASIDE_PROVIDES_TYPE, provides_path));
+      g_debug (" lookaside-provides: %s", provides_path);
+    }
   g_autofree char *yaml_path = g_build_filename (testpath, "modules.yaml", NULL);
   if (g_file_test (yaml_path, G_FILE_TEST_IS_REGULAR))
     {
       g_ptr_array_add (tdata->repos, g_strdup_printf ("yaml,modular,%s", yaml_path));
       g_debug (" yaml: %s", yaml_path);
     }
+  /* Defaults given apart from the modules they apply to */
+  g_autofree char *defaults_path = g_build_filename (testpath, "defaults.yaml", NULL);
+  if (g_file_test (defaults_path, G_FILE_TEST_IS_REGULAR))
+    {
+      g_ptr_array_add (tdata->repos, g_strdup_printf ("defaults,modular,%s", defaults_path));
+      g_debug (" defaults: %s", defaults_path);
+    }
   g_ptr_array_add (tdata->repos, NULL);
 }
 
@@ -240,6 +1219,12 @@ int main (int argc, char **argv)
 {
   setlocale (LC_ALL, "");
 
+  /* Keep the repo caches of the tests away from the user's */
+  g_autoptr(GError) error = NULL;
+  g_autofree gchar *cachedir = g_dir_make_tmp ("fus-cache-XXXXXX", &error);
+  g_assert_no_error (error);
+  g_setenv ("XDG_CACHE_HOME", cachedir, TRUE);
+
   g_test_init (&argc, &argv, NULL);
   g_test_bug_base ("https://github.com/fedora-modularity/fus/issues");
 
@@ -258,8 +1243,11 @@ int main (int argc, char **argv)
   ADD_TEST ("/require/empty", "empty");
   ADD_TEST ("/require/alternatives", "alternatives");
   ADD_TEST ("/module/empty", "empty-module");
+  g_test_add ("/module/artifacts-in-later-repo", TestData, "positive",
+              test_setup, test_modules_first, test_teardown);
   ADD_TEST ("/solvable-selection/pull-bare", "pull-bare");
   ADD_TEST ("/solvable-selection/pull-from-default-stream", "pull-default-module");
+  ADD_TEST ("/solvable-selection/defaults-in-other-repo", "defaults-in-other-repo");
   ADD_TEST ("/solvable-selection/explicit-nevra", "explicit-nevra");
   ADD_TEST ("/ursine/ignore-weak-deps", "weak-deps");
 
@@ -274,18 +1262,39 @@ int main (int argc, char **argv)
   g_test_add_func ("/fail/no-solvables", test_fail_no_solvables);
   g_test_add_func ("/fail/invalid-solvable", test_fail_invalid_solvable);
 
+  g_test_add_func ("/download/resume", test_download_resume);
+  g_test_add_func ("/download/stream-resume", test_download_stream_resume);
+  g_test_add_func ("/download/cacheonly", test_cacheonly);
+  g_test_add_func ("/download/zchunk", test_zck_download);
+  g_test_add_func ("/mirrors/parse", test_mirrors_parse);
+  g_test_add_func ("/mirrors/rank", test_mirrors_rank);
+  g_test_add_func ("/cache/gc", test_cache_gc);
+
   ADD_TEST ("/ursine/default-stream-dep", "default-stream");
   ADD_TEST ("/ursine/prefer-over-non-default-stream", "non-default-stream");
 
   ADD_TEST ("/lookaside/same-repo", "input-as-lookaside");
+  ADD_TEST ("/lookaside/provides-only", "lookaside-provides");
+  ADD_TEST ("/lookaside/provides-only-primary-files", "lookaside-provides-files");
+
+  g_test_add ("/prune/arch-and-excludes", TestData, "prune", test_setup, test_prune, test_teardown);
+  g_test_add_func ("/prune/warm-cache", test_prune_warm_cache);
+  g_test_add_func ("/snapshot/load", test_snapshot);
+  g_test_add_func ("/snapshot/gc", test_snapshot_gc);
+  g_test_add_func ("/modular/cache", test_modular_cache);
+  g_test_add_func ("/modular/overlay", test_modular_overlay);
 
   ADD_SOLV_FAIL_TEST ("/fail/ursine/broken", "ursine-broken");
   ADD_SOLV_FAIL_TEST ("/fail/module/broken", "module-broken");
   ADD_SOLV_FAIL_TEST ("/fail/moddep/broken", "moddep-broken");
 
   ADD_TEST ("/module/multiple", "build-in-more-modules");
+  g_test_add ("/module/stream-versions-in-chunks", TestData, "stream-versions-in-chunks",
+              test_setup, test_small_chunks, test_teardown);
 
   ADD_TEST ("/modulemd-packager-v3/static-context", "static-context");
 
-  return g_test_run ();
+  int ret = g_test_run ();
+  remove_tree (cachedir);
+  return ret;
 }
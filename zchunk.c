@@ -0,0 +1,550 @@
+#include "download.h"
+
+#include <errno.h>
+#include <gio/gio.h>
+#include <glib/gstdio.h>
+#include <string.h>
+
+/*
+ * Incremental downloads of zchunk files.
+ *
+ * A zchunk file is a header, listing the checksum and compressed size of
+ * each chunk, followed by the independently compressed chunks. Chunks of the
+ * new file that are also present in an older version of it (the seed) are
+ * copied from there, and only the remaining ones are fetched from the server
+ * with range requests.
+ */
+
+#define ZCK_MAGIC "\0ZCK1"
+#define ZCK_MAGIC_LEN 5
+/* Enough for the lead and usually for the whole header of small files */
+#define ZCK_HEADER_PREFETCH (16 * 1024)
+#define ZCK_BUFSIZE (64 * 1024)
+/* Headers are read into memory, so anything claiming to be bigger than this
+ * is taken as corrupt. Even huge repos have headers of a few hundred KiB. */
+#define ZCK_HEADER_MAX (4 * 1024 * 1024)
+
+#define ZCK_FLAG_STREAMS (1 << 0)
+#define ZCK_FLAG_OPTIONAL_ELEMENTS (1 << 1)
+
+typedef struct
+{
+  const guchar *chksum;
+  guint64       offset;
+  guint64       length;
+} ZckChunk;
+
+typedef struct
+{
+  GByteArray *data;
+  /* Length of the lead and header, i.e. offset of the first chunk */
+  guint64     len;
+  guint64     chksumtype;
+  int         chksumlen;
+  GArray     *chunks;
+} ZckHeader;
+
+static void
+zck_header_free (ZckHeader *hdr)
+{
+  if (hdr->data)
+    g_byte_array_unref (hdr->data);
+  if (hdr->chunks)
+    g_array_unref (hdr->chunks);
+  g_free (hdr);
+}
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC(ZckHeader, zck_header_free);
+
+static int
+zck_chksum_len (guint64 type)
+{
+  switch (type)
+    {
+    case 0: /* SHA-1 */
+      return 20;
+    case 1: /* SHA-256 */
+      return 32;
+    case 2: /* SHA-512 */
+      return 64;
+    case 3: /* SHA-512 truncated to 128 bits */
+      return 16;
+    default:
+      return -1;
+    }
+}
+
+/* Integers are stored 7 bits per byte, little-endian, the last byte having
+ * the most significant bit set */
+static gboolean
+read_compint (const guchar *buf,
+              gsize         len,
+              gsize        *pos,
+              guint64      *val)
+{
+  guint64 v = 0;
+  for (int shift = 0; *pos < len && shift < 64; shift += 7)
+    {
+      guchar c = buf[(*pos)++];
+      v |= (guint64) (c & 0x7f) << shift;
+      if (c & 0x80)
+        {
+          *val = v;
+          return TRUE;
+        }
+    }
+
+  return FALSE;
+}
+
+static gboolean
+zck_header_error (GError **error)
+{
+  g_set_error_literal (error,
+                       G_OPTION_ERROR, G_OPTION_ERROR_FAILED,
+                       "Invalid zchunk header");
+  return FALSE;
+}
+
+/*
+ * Parse the lead at the beginning of @data to find out the full header
+ * length. Returns FALSE only if the data are not a zchunk file, @len is left
+ * at 0 if more data are needed.
+ */
+static gboolean
+zck_parse_lead (GByteArray  *data,
+                guint64     *len,
+                GError     **error)
+{
+  gsize pos = ZCK_MAGIC_LEN;
+  guint64 type, size;
+
+  *len = 0;
+  if (data->len < ZCK_MAGIC_LEN)
+    return TRUE;
+  if (memcmp (data->data, ZCK_MAGIC, ZCK_MAGIC_LEN) != 0)
+    return zck_header_error (error);
+
+  if (!read_compint (data->data, data->len, &pos, &type) ||
+      !read_compint (data->data, data->len, &pos, &size))
+    return TRUE;
+
+  int chksumlen = zck_chksum_len (type);
+  if (chksumlen < 0 || size > ZCK_HEADER_MAX - pos - chksumlen)
+    return zck_header_error (error);
+
+  *len = pos + chksumlen + size;
+  return TRUE;
+}
+
+static ZckHeader *
+zck_parse_header (GByteArray  *data,
+                  GError     **error)
+{
+  const guchar *buf = data->data;
+  gsize pos = ZCK_MAGIC_LEN;
+  guint64 type, size, flags, comptype, count;
+
+  g_autoptr(ZckHeader) hdr = g_new0 (ZckHeader, 1);
+  hdr->data = g_byte_array_ref (data);
+  hdr->chunks = g_array_new (FALSE, FALSE, sizeof (ZckChunk));
+
+  /* Lead */
+  if (data->len < ZCK_MAGIC_LEN || memcmp (buf, ZCK_MAGIC, ZCK_MAGIC_LEN) != 0 ||
+      !read_compint (buf, data->len, &pos, &type) ||
+      !read_compint (buf, data->len, &pos, &size) ||
+      zck_chksum_len (type) < 0)
+    {
+      zck_header_error (error);
+      return NULL;
+    }
+  pos += zck_chksum_len (type);
+  if (size > ZCK_HEADER_MAX - pos)
+    {
+      zck_header_error (error);
+      return NULL;
+    }
+  hdr->len = pos + size;
+  if (hdr->len > data->len)
+    {
+      zck_header_error (error);
+      return NULL;
+    }
+
+  /* Preface */
+  pos += zck_chksum_len (type);
+  if (!read_compint (buf, hdr->len, &pos, &flags) ||
+      !read_compint (buf, hdr->len, &pos, &comptype))
+    {
+      zck_header_error (error);
+      return NULL;
+    }
+  if (flags & ZCK_FLAG_OPTIONAL_ELEMENTS)
+    {
+      guint64 nelems;
+      if (!read_compint (buf, hdr->len, &pos, &nelems))
+        {
+          zck_header_error (error);
+          return NULL;
+        }
+      for (guint64 i = 0; i < nelems; i++)
+        {
+          guint64 id, elemsize;
+          if (!read_compint (buf, hdr->len, &pos, &id) ||
+              !read_compint (buf, hdr->len, &pos, &elemsize) ||
+              elemsize > hdr->len - pos)
+            {
+              zck_header_error (error);
+              return NULL;
+            }
+          pos += elemsize;
+        }
+    }
+
+  /* Index */
+  if (!read_compint (buf, hdr->len, &pos, &size) ||
+      !read_compint (buf, hdr->len, &pos, &hdr->chksumtype) ||
+      !read_compint (buf, hdr->len, &pos, &count) ||
+      (hdr->chksumlen = zck_chksum_len (hdr->chksumtype)) < 0)
+    {
+      zck_header_error (error);
+      return NULL;
+    }
+
+  /* The first chunk is the compression dictionary, it's handled just like
+   * the others here */
+  guint64 offset = hdr->len;
+  for (guint64 i = 0; i < count; i++)
+    {
+      ZckChunk chunk = { 0 };
+      guint64 stream, ulength;
+
+      if (pos + hdr->chksumlen > hdr->len)
+        {
+          zck_header_error (error);
+          return NULL;
+        }
+      chunk.chksum = buf + pos;
+      pos += hdr->chksumlen;
+
+      if (((flags & ZCK_FLAG_STREAMS) && !read_compint (buf, hdr->len, &pos, &stream)) ||
+          !read_compint (buf, hdr->len, &pos, &chunk.length) ||
+          !read_compint (buf, hdr->len, &pos, &ulength))
+        {
+          zck_header_error (error);
+          return NULL;
+        }
+
+      chunk.offset = offset;
+      offset += chunk.length;
+      g_array_append_val (hdr->chunks, chunk);
+    }
+
+  return g_steal_pointer (&hdr);
+}
+
+static ZckHeader *
+zck_read_header (FILE    *fp,
+                 GError **error)
+{
+  g_autoptr(GByteArray) data = g_byte_array_new ();
+  guint64 len = 0;
+
+  g_byte_array_set_size (data, ZCK_HEADER_PREFETCH);
+  g_byte_array_set_size (data, fread (data->data, 1, data->len, fp));
+  if (!zck_parse_lead (data, &len, error))
+    return NULL;
+  if (!len)
+    {
+      zck_header_error (error);
+      return NULL;
+    }
+
+  if (len > data->len)
+    {
+      gsize have = data->len;
+      g_byte_array_set_size (data, len);
+      if (fread (data->data + have, 1, len - have, fp) != len - have)
+        {
+          zck_header_error (error);
+          return NULL;
+        }
+    }
+
+  return zck_parse_header (data, error);
+}
+
+/*
+ * Fetch the [@start, @end] byte range of @url, appending it to @data if
+ * given, otherwise writing it to @out and adding it to @chk.
+ */
+static gboolean
+range_fetch (SoupSession    *session,
+             const char     *url,
+             guint64         start,
+             guint64         end,
+             GByteArray     *data,
+             GOutputStream  *out,
+             Chksum         *chk,
+             GError        **error)
+{
+  g_autoptr(SoupMessage) msg = soup_message_new ("GET", url);
+  soup_message_headers_set_range (msg->request_headers, start, end);
+  g_autoptr(GInputStream) istream = soup_session_send (session, msg, NULL, error);
+  if (!istream)
+    return FALSE;
+
+  if (msg->status_code != SOUP_STATUS_PARTIAL_CONTENT)
+    {
+      g_set_error (error,
+                   G_OPTION_ERROR, G_OPTION_ERROR_FAILED,
+                   "Range request returned %u %s",
+                   msg->status_code, msg->reason_phrase);
+      return FALSE;
+    }
+
+  guchar buf[ZCK_BUFSIZE];
+  guint64 remaining = end - start + 1;
+  while (remaining)
+    {
+      gssize len = g_input_stream_read (istream, buf, MIN (sizeof (buf), remaining), NULL, error);
+      if (len < 0)
+        return FALSE;
+      if (len == 0)
+        {
+          g_set_error (error,
+                       G_OPTION_ERROR, G_OPTION_ERROR_FAILED,
+                       "Range request returned less data than requested");
+          return FALSE;
+        }
+
+      if (data)
+        g_byte_array_append (data, buf, len);
+      else
+        {
+          solv_chksum_add (chk, buf, len);
+          if (!g_output_stream_write_all (out, buf, len, NULL, NULL, error))
+            return FALSE;
+        }
+      remaining -= len;
+    }
+
+  return TRUE;
+}
+
+static ZckHeader *
+zck_fetch_header (SoupSession  *session,
+                  const char   *url,
+                  GError      **error)
+{
+  g_autoptr(GByteArray) data = g_byte_array_new ();
+  guint64 len = 0;
+
+  if (!range_fetch (session, url, 0, ZCK_HEADER_PREFETCH - 1, data, NULL, NULL, error))
+    return NULL;
+  if (!zck_parse_lead (data, &len, error))
+    return NULL;
+  if (!len)
+    {
+      zck_header_error (error);
+      return NULL;
+    }
+
+  if (len > data->len &&
+      !range_fetch (session, url, data->len, len - 1, data, NULL, NULL, error))
+    return NULL;
+
+  return zck_parse_header (data, error);
+}
+
+static GBytes *
+chunk_key (ZckHeader *hdr,
+           ZckChunk  *chunk)
+{
+  return g_bytes_new_static (chunk->chksum, hdr->chksumlen);
+}
+
+static gboolean
+copy_range (FILE           *fp,
+            guint64         offset,
+            guint64         length,
+            GOutputStream  *out,
+            Chksum         *chk,
+            GError        **error)
+{
+  guchar buf[ZCK_BUFSIZE];
+
+  if (fseeko (fp, offset, SEEK_SET) == -1)
+    {
+      g_set_error (error,
+                   G_OPTION_ERROR, G_OPTION_ERROR_FAILED,
+                   "Could not seek in seed file: %s", g_strerror (errno));
+      return FALSE;
+    }
+
+  while (length)
+    {
+      size_t len = fread (buf, 1, MIN (sizeof (buf), length), fp);
+      if (!len)
+        {
+          g_set_error_literal (error,
+                               G_OPTION_ERROR, G_OPTION_ERROR_FAILED,
+                               "Seed file is truncated");
+          return FALSE;
+        }
+      solv_chksum_add (chk, buf, len);
+      if (!g_output_stream_write_all (out, buf, len, NULL, NULL, error))
+        return FALSE;
+      length -= len;
+    }
+
+  return TRUE;
+}
+
+static gboolean
+zck_assemble (SoupSession    *session,
+              const char     *url,
+              ZckHeader      *hdr,
+              ZckHeader      *seedhdr,
+              FILE           *seedfp,
+              GOutputStream  *out,
+              Chksum         *chk,
+              GError        **error)
+{
+  g_autoptr(GHashTable) seedchunks = g_hash_table_new_full (g_bytes_hash, g_bytes_equal,
+                                                            (GDestroyNotify) g_bytes_unref, NULL);
+  guint64 reused = 0, fetched = 0;
+
+  /* Chunks can only be compared if they use the same checksum */
+  if (seedhdr->chksumtype == hdr->chksumtype)
+    for (unsigned int i = 0; i < seedhdr->chunks->len; i++)
+      {
+        ZckChunk *chunk = &g_array_index (seedhdr->chunks, ZckChunk, i);
+        g_hash_table_insert (seedchunks, chunk_key (seedhdr, chunk), chunk);
+      }
+
+  solv_chksum_add (chk, hdr->data->data, hdr->len);
+  if (!g_output_stream_write_all (out, hdr->data->data, hdr->len, NULL, NULL, error))
+    return FALSE;
+
+  for (unsigned int i = 0; i < hdr->chunks->len; )
+    {
+      ZckChunk *chunk = &g_array_index (hdr->chunks, ZckChunk, i);
+      g_autoptr(GBytes) key = chunk_key (hdr, chunk);
+      ZckChunk *seed = g_hash_table_lookup (seedchunks, key);
+      if (seed)
+        {
+          if (!copy_range (seedfp, seed->offset, seed->length, out, chk, error))
+            return FALSE;
+          reused += chunk->length;
+          i++;
+          continue;
+        }
+
+      /* Fetch all consecutive missing chunks in one request */
+      guint64 start = chunk->offset, end = chunk->offset + chunk->length;
+      for (i++; i < hdr->chunks->len; i++)
+        {
+          ZckChunk *next = &g_array_index (hdr->chunks, ZckChunk, i);
+          g_autoptr(GBytes) nextkey = chunk_key (hdr, next);
+          if (g_hash_table_contains (seedchunks, nextkey))
+            break;
+          end = next->offset + next->length;
+        }
+
+      if (end > start &&
+          !range_fetch (session, url, start, end - 1, NULL, out, chk, error))
+        return FALSE;
+      fetched += end - start;
+    }
+
+  g_debug ("zchunk: reused %" G_GUINT64_FORMAT " bytes from seed, fetched %" G_GUINT64_FORMAT " bytes",
+           reused, fetched);
+
+  return TRUE;
+}
+
+/**
+ * zck_download:
+ * @session: session used for the requests
+ * @url: URL of the zchunk file
+ * @path: where to store the file
+ * @seed: path of an older version of the file
+ * @chksumtype: type of @chksum
+ * @chksum: expected checksum of the whole file
+ * @error: return location for a #GError
+ *
+ * Download a zchunk file, fetching only the chunks which are not in @seed.
+ * @seed and @path may be the same file.
+ *
+ * Returns: %FALSE on failure, in which case a full download should be tried
+ */
+gboolean
+zck_download (SoupSession          *session,
+              const char           *url,
+              const char           *path,
+              const char           *seed,
+              Id                    chksumtype,
+              const unsigned char  *chksum,
+              GError              **error)
+{
+  g_debug ("Downloading %s to %s using %s as seed", url, path, seed);
+
+  FILE *seedfp = g_fopen (seed, "rb");
+  if (!seedfp)
+    {
+      g_set_error (error,
+                   G_OPTION_ERROR, G_OPTION_ERROR_FAILED,
+                   "Could not open %s: %s", seed, g_strerror (errno));
+      return FALSE;
+    }
+
+  g_autoptr(ZckHeader) seedhdr = zck_read_header (seedfp, error);
+  g_autoptr(ZckHeader) hdr = seedhdr ? zck_fetch_header (session, url, error) : NULL;
+  if (!hdr)
+    {
+      fclose (seedfp);
+      return FALSE;
+    }
+
+  /* Written to a temporary file renamed over @path on close, so @seed can
+   * be the file being replaced */
+  g_autoptr(GFile) file = g_file_new_for_path (path);
+  g_autoptr(GFileOutputStream) out = g_file_replace (file,
+                                                     NULL,
+                                                     FALSE,
+                                                     G_FILE_CREATE_REPLACE_DESTINATION,
+                                                     NULL,
+                                                     error);
+  if (!out)
+    {
+      fclose (seedfp);
+      return FALSE;
+    }
+
+  Chksum *chk = solv_chksum_create (chksumtype);
+  Chksum *expected = solv_chksum_create_from_bin (chksumtype, chksum);
+  gboolean ret = zck_assemble (session, url, hdr, seedhdr, seedfp, G_OUTPUT_STREAM (out), chk, error);
+  fclose (seedfp);
+
+  if (ret && !solv_chksum_cmp (chk, expected))
+    {
+      g_set_error (error,
+                   G_OPTION_ERROR, G_OPTION_ERROR_FAILED,
+                   "Checksum mismatch for %s", url);
+      ret = FALSE;
+    }
+  solv_chksum_free (expected, NULL);
+  solv_chksum_free (chk, NULL);
+
+  if (!ret)
+    {
+      /* Don't let the incomplete file replace @path */
+      g_autoptr(GCancellable) cancellable = g_cancellable_new ();
+      g_cancellable_cancel (cancellable);
+      g_output_stream_close (G_OUTPUT_STREAM (out), cancellable, NULL);
+      return FALSE;
+    }
+
+  return g_output_stream_close (G_OUTPUT_STREAM (out), NULL, error);
+}